@@ -53,8 +53,6 @@ uint16_t blue_led = 0;
 
 float temperature;
 float humidity;
-unsigned long last_temp_measurement;
-unsigned long last_temp_stored;
 
 AMController am_controller;
 
@@ -115,43 +113,47 @@ void doSync()
 void doWork()
 {
     // printf("doWork\n");
-    adc_select_input(2);
-    pot = adc_read();
+    pot = am_controller.adc_value(2);
 
-    // DHT22 can be read at most once every 2s
-    if (time_us_64() / 1000 - last_temp_measurement > 2000)
+    // sleep_ms(100);
+}
+
+/**
+ *
+ * Task run every 2s: DHT22 can be read at most once every 2s
+ *
+ */
+void readTemperature()
+{
+    printf("Reading DHT22 sensor... ");
+
+    bool data_ok = DHT_read(&temperature, &humidity);
+    if (data_ok)
     {
-        last_temp_measurement = time_us_64() / 1000;
-
-        printf("Reading DHT22 sensor... ");
-
-        bool data_ok = DHT_read(&temperature, &humidity);
-        if (data_ok)
-        {
-            printf("Temperature: %.2f C, Humidity: %.2f%% RH\n", temperature, humidity);
-        }
-        else
-        {
-            printf("\n");
-        }
+        printf("Temperature: %.2f C, Humidity: %.2f%% RH\n", temperature, humidity);
     }
-
-    // Temperature is stored every 30s
-    if (time_us_64() / 1000 - last_temp_stored > 30000)
+    else
     {
-        last_temp_stored = time_us_64() / 1000;
-        if (am_controller.log_size("Temp_History") > 2000)
-        {
-            am_controller.log_purge_data("Temp_History");
-            printf("Temp_History data purged");
-            am_controller.log_labels("Temp_History", "Temperature", "Humidity");
-        }
-        unsigned long now = am_controller.now();
-        am_controller.log_value("Temp_History", now, temperature, humidity);
-        printf("Temperature and Humidity stored into file\n");
+        printf("\n");
     }
+}
 
-    // sleep_ms(100);
+/**
+ *
+ * Task run every 30s: temperature and humidity are stored
+ *
+ */
+void storeTemperature()
+{
+    if (am_controller.log_size("Temp_History") > 2000)
+    {
+        am_controller.log_purge_data("Temp_History");
+        printf("Temp_History data purged");
+        am_controller.log_labels("Temp_History", "Temperature", "Humidity");
+    }
+    unsigned long now = am_controller.now();
+    am_controller.log_value("Temp_History", now, temperature, humidity);
+    printf("Temperature and Humidity stored into file\n");
 }
 
 /**
@@ -261,6 +263,10 @@ int main()
 
     adc_set_temp_sensor_enabled(true);
 
+    // Potentiometer (input 2) sampled in the background, the median filter removes the spikes
+    am_controller.adc_set_filter(2, ADC_FILTER_MEDIAN, 5);
+    am_controller.adc_sampler_start(2, 1000, NULL);
+
     // Initialize the DHT22 sensor on the specified GPIO pin
     DHT_init(TEMPERATUREPIN);
 
@@ -278,6 +284,13 @@ int main()
     // Inizialize the file for the Logged Data Widget
     am_controller.log_labels("Temp_History", "Temperature", "Humidity");
 
+    am_controller.add_task(&readTemperature, 2000, 1);
+    am_controller.add_task(&storeTemperature, 30000, 0);
+
+    // Optional: run the log writes on core 1, so that storing a value only queues it and log_size()
+    // reads the size sent back by core 1. Core 1 is then taken by the library
+    // am_controller.set_sd_on_core1(true);
+
     am_controller.init(
         &doWork,
         &doSync,
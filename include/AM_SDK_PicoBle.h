@@ -29,6 +29,8 @@
 #include <stdlib.h>
 
 #include "pico/stdlib.h"
+#include "pico/sem.h"
+#include "btstack_config.h"
 #include "btstack_defines.h"
 #include "ble/att_db.h"
 #include "ble/att_server.h"
@@ -36,8 +38,14 @@
 #include "bluetooth_gatt.h"
 #include "btstack_debug.h"
 
+#include "AM_ADCSampler.h"
 #include "AM_Alarms.h"
-#include "AM_SDManager.h"
+#include "AM_Format.h"
+#include "AM_Parser.h"
+#include "AM_Pulses.h"
+#include "AM_Queue.h"
+#include "AM_Scheduler.h"
+#include "AM_SDWorker.h"
 
 #ifdef DEBUG
 #define DEBUG_printf printf
@@ -45,11 +53,87 @@
 #define DEBUG_printf
 #endif
 
+// Max length of the variable and of the value of a message received from the device.
+// Can be overridden at compile time (e.g. -DVALUELEN=128). Longer messages are discarded.
+#ifndef VARIABLELEN
 #define VARIABLELEN 14
-#define VALUELEN 14
+#endif
+#ifndef VALUELEN
+#define VALUELEN 64
+#endif
 
 #define BUF_SIZE 2048
 
+// Max length of an outgoing <variable>=<value># message, at least 100: a name of VARIABLELEN
+// fits with a value of VALUELEN or a formatted number (FORMAT_MAX_SIZE, its '\0' counting for the #)
+#define OUTGOING_VALUE_SIZE (VALUELEN + 1 > FORMAT_MAX_SIZE ? VALUELEN + 1 : FORMAT_MAX_SIZE)
+#define OUTGOING_MESSAGE_SIZE (VARIABLELEN + 1 + OUTGOING_VALUE_SIZE)
+#define OUTGOING_FRAME_SIZE (OUTGOING_MESSAGE_SIZE > 100 ? OUTGOING_MESSAGE_SIZE : 100)
+
+// Largest ATT payload allowed by the ACL buffers (L2CAP and ATT headers excluded).
+// The payload actually usable on a connection is MTU - 3 (see AMController::max_payload_size())
+#define ATT_MAX_PAYLOAD_SIZE (HCI_ACL_PAYLOAD_SIZE - 4 - 3)
+
+#define OUTGOING_QUEUE_SIZE 16  // Max number of outgoing messages waiting to be notified
+#define MAX_DEADBANDS 16        // Max number of variables with a deadband
+#define MAX_MESSAGE_HANDLERS 48 // Max number of variables with a registered handler
+#define INCOMING_QUEUE_SIZE 32  // Max number of received messages waiting to be processed (power of 2)
+#define LONG_WRITE_SIZE 512     // Max length of a long (prepared) write, the largest attribute value allowed by ATT
+
+// Outgoing messages queue statistics
+typedef struct
+{
+    uint32_t queued;           // Messages added to the queue
+    uint32_t sent;             // Messages notified to the device
+    uint32_t notifications;    // Notifications used to send them (several messages are packed in one)
+    uint32_t coalesced;        // Messages that replaced a pending value of the same variable
+    uint32_t suppressed;       // Values not sent because within the deadband of the last value sent
+    uint32_t dropped_full;     // Messages discarded because the queue was full
+    uint32_t dropped_too_long; // Messages discarded because longer than OUTGOING_FRAME_SIZE or the MTU allows
+    uint16_t high_water_mark;  // Max number of messages pending at the same time
+} outgoing_queue_stats_t;
+
+// Message received from the device, parsed in place in the incoming queue
+typedef ParsedMessage<VARIABLELEN, VALUELEN> incoming_message_t;
+
+// Incoming messages queue statistics
+typedef struct
+{
+    uint32_t received;         // Messages queued for processing
+    uint32_t dropped_full;     // Messages discarded because the queue was full
+    uint32_t dropped_too_long; // Messages discarded because longer than VARIABLELEN / VALUELEN
+} incoming_queue_stats_t;
+
+// Main loop activity: the share of time spent sleeping drives the average current
+typedef struct
+{
+    uint64_t idle_us;     // Time spent waiting for an event or a deadline
+    uint64_t busy_us;     // Time spent handling events, tasks and doWork
+    uint32_t wakeups;     // Waits ended
+    uint64_t max_idle_us; // Longest wait
+} idle_stats_t;
+
+// Link layer status of the current connection
+typedef struct
+{
+    uint16_t max_tx_octets; // Max link layer payload, 27 without Data Length Extension
+    uint16_t max_rx_octets;
+    uint8_t tx_phy; // 1: LE 1M, 2: LE 2M, 3: LE Coded
+    uint8_t rx_phy;
+    uint16_t conn_interval;       // Connection interval (1.25 ms units)
+    uint16_t conn_latency;        // Slave latency (connection events)
+    uint16_t supervision_timeout; // Supervision timeout (10 ms units)
+} link_status_t;
+
+// Connection parameters profiles
+typedef enum
+{
+    CONNECTION_PROFILE_DEFAULT,     // Parameters chosen by the central
+    CONNECTION_PROFILE_LOW_LATENCY, // 15-30 ms interval
+    CONNECTION_PROFILE_BALANCED,    // 30-60 ms interval
+    CONNECTION_PROFILE_LOW_POWER    // 100-200 ms interval, slave latency 4
+} connection_profile_t;
+
 // Create a struct for managing this service
 typedef struct
 {
@@ -66,11 +150,43 @@ typedef struct
     uint16_t characteristic_d_client_configuration_handle;
     uint16_t characteristic_d_user_description_handle;
 
-    btstack_context_callback_registration_t callback_d;
+} custom_service_t;
 
-    char buffer[64];
+/**
+ * Variable name checked at compile time:
+ *
+ *     static constexpr auto LED = am_variable("Led");
+ *     am_controller.write_message(LED, led);
+ *
+ * Names longer than VARIABLELEN do not compile, and the <name>= prefix
+ * of the messages is built at compile time, so sending a message only
+ * copies it and formats the value.
+ */
+template <size_t N>
+class AMVariable
+{
+    static_assert(N > 1, "Empty variable name");
+    static_assert(N - 1 <= VARIABLELEN, "Variable name longer than VARIABLELEN");
 
-} custom_service_t;
+public:
+    static constexpr size_t length = N - 1;
+    char prefix[N + 1]; // <name>= as copied at the start of the messages
+
+    constexpr AMVariable(const char (&variable)[N]) : prefix()
+    {
+        for (size_t i = 0; i < length; i++)
+        {
+            prefix[i] = variable[i];
+        }
+        prefix[length] = '=';
+    }
+};
+
+template <size_t N>
+constexpr AMVariable<N> am_variable(const char (&variable)[N])
+{
+    return AMVariable<N>(variable);
+}
 
 class SDManager;
 
@@ -87,24 +203,58 @@ private:
 
     bool is_device_connected;
     bool is_sync_completed;
+    bool coalesce_messages; // A new value replaces the pending one of the same variable
 
-    char characteristic_d_rx[100];
+    char characteristic_d_rx[ATT_MAX_PAYLOAD_SIZE + 1];
+    uint16_t att_mtu; // ATT MTU negotiated with the connected device
+
+    bool link_upgrade;            // Request Data Length Extension and LE 2M PHY on connection
+    uint8_t link_upgrade_pending; // Link upgrade requests not yet sent to the controller
+    link_status_t link_status;
+
+    connection_profile_t connection_profile;      // Last profile requested on the current connection
+    bool auto_connection_profile;                 // Switch profile depending on the activity
+    connection_profile_t idle_connection_profile; // Profile used when neither syncing nor transferring files
     btstack_packet_callback_registration_t hci_event_callback_registration;
 
     SDManager *sd_manager;
 
     Alarms alarms;
-    struct repeating_timer alarms_checks_timer;
-    static bool alarm_timer_callback(__unused struct repeating_timer *t);
+    bool alarms_enabled;           // processAlarms set and SD card mounted at startup
+    bool time_set;                 // $Time$ received: until then the clock runs from a default date
+    alarm_id_t alarms_check_alarm; // One-shot timer at the time of the next alarm, 0 if none
+    volatile bool alarms_check_due; // Set by the alarms timer, alarms are checked by the main loop
+    static int64_t alarm_timer_callback(alarm_id_t id, void *user_data);
+    void schedule_alarms_check();
 
     char file_to_send[128]; // Name of the log file to send
-    int already_read_bytes;    // Log file bytes already sent
 
     bool send_log_file;     // Sending Log File
     bool send_dir;          // Sending SD file list
     bool send_file_content; // Sending file content
 
+    semaphore_t wake_up_sem; // Released from the BTstack context and timers when the main loop has work to do
+    bool wake_up_ready;      // wake_up_sem and the poll mode worker are set up by init()
+    uint32_t work_period_ms; // doWork and processOutgoingMessages period
+    volatile bool work_requested;
+
+    TaskScheduler scheduler;
+
+    PulseGenerator pulses;
+
+    ADCSampler adc_sampler;
+
+    bool sd_on_core1; // Log writes run on core 1
+
+    bool low_power_idle; // No periodic doWork while disconnected
+    idle_stats_t idle_stats;
+
+    SPSCQueue<incoming_message_t, INCOMING_QUEUE_SIZE> incoming_queue; // Filled by the write callback, drained by the main loop
+    incoming_queue_stats_t incoming_stats;
+
 public:
+    AMController();
+
     void init(
         void (*doWork)(void),
         void (*doSync)(void),
@@ -121,14 +271,61 @@ public:
     void write_message(const char *variable, const char *value);
     void write_message_immediate(const char *variable, const char *value);
     void notifiy_message(const char *variable, const char *value);
-    void notify_buffer(const char *value, uint size);
+    bool notify_buffer(const char *value, uint size);
     void write_message_buffer(const char *value, uint size);
     int can_send_message();
+    uint16_t get_mtu();
+    uint16_t max_payload_size();
+
+    void set_link_upgrade(bool enabled);
+    void get_link_status(link_status_t *status);
+
+    void request_connection_profile(connection_profile_t profile);
+    void set_auto_connection_profile(bool enabled, connection_profile_t idle_profile);
+    connection_profile_t get_connection_profile();
 
     void write_message(const char *variable, float x, float y, float z);
 
+    template <size_t N>
+    void write_message(const AMVariable<N> &variable, int value) { queue_long(variable.prefix, AMVariable<N>::length, true, value); }
+    template <size_t N>
+    void write_message(const AMVariable<N> &variable, long value) { queue_long(variable.prefix, AMVariable<N>::length, true, value); }
+    template <size_t N>
+    void write_message(const AMVariable<N> &variable, unsigned long value) { queue_unsigned_long(variable.prefix, AMVariable<N>::length, true, value); }
+    template <size_t N>
+    void write_message(const AMVariable<N> &variable, float value) { queue_float(variable.prefix, AMVariable<N>::length, true, value); }
+    template <size_t N>
+    void write_message(const AMVariable<N> &variable, const char *value) { queue_string(variable.prefix, AMVariable<N>::length, true, value, coalesce_messages); }
+    template <size_t N>
+    void write_message(const AMVariable<N> &variable, float x, float y, float z) { queue_xyz(variable.prefix, AMVariable<N>::length, true, x, y, z); }
+
+    void set_coalescing(bool enabled);
+    bool set_deadband(const char *variable, float absolute, float relative, uint32_t refresh_ms);
+    void clear_deadband(const char *variable);
+    uint16_t outgoing_queue_pending();
+    void get_outgoing_queue_stats(outgoing_queue_stats_t *stats);
+    void reset_outgoing_queue_stats();
+
+    void set_work_period(uint32_t period_ms);
+    void request_work();
+
+    int add_task(void (*task)(void), uint32_t period_ms, uint8_t priority);
+    int add_one_shot_task(void (*task)(void), uint32_t delay_ms, uint8_t priority);
+    bool remove_task(int id);
+    bool get_task_stats(int id, task_stats_t *stats);
+    void reset_task_stats(int id);
+
+    void get_incoming_queue_stats(incoming_queue_stats_t *stats);
+    void reset_incoming_queue_stats();
+
     unsigned long now();
 
+    bool register_handler(const char *variable, void (*handler)(bool value));
+    bool register_handler(const char *variable, void (*handler)(long value));
+    bool register_handler(const char *variable, void (*handler)(float value));
+    bool register_handler(const char *variable, void (*handler)(const char *value));
+    bool register_handler(const char *variable, void (*handler)(float x, float y, float z));
+
     void log(int msg);
     void log(long msg);
     void log(unsigned long msg);
@@ -155,10 +352,29 @@ public:
     unsigned long log_size(const char *variable);
     void log_purge_data(const char *variable);
 
-    void gpio_temporary_put(uint pin, bool value, uint ms);
+    void set_sd_on_core1(bool enabled);
+    void get_sd_worker_stats(sd_worker_stats_t *stats);
+
+    void set_low_power_idle(bool enabled);
+    void get_idle_stats(idle_stats_t *stats);
+    void reset_idle_stats();
+
+    bool gpio_temporary_put(uint pin, bool value, uint ms);
+    bool gpio_pulse_train(uint pin, bool value, uint on_ms, uint off_ms, uint16_t count);
+    bool gpio_pulse_stop(uint pin);
+    bool gpio_pulse_active(uint pin);
     float to_voltage(uint16_t adc_value, float vref);
     uint16_t avg_adc_read(uint8_t samples);
 
+    bool adc_sampler_start(uint input, uint32_t sample_rate, adc_block_callback_t block_callback);
+    bool adc_sampler_start_inputs(uint input_mask, uint32_t sample_rate, adc_block_callback_t block_callback);
+    void adc_sampler_stop();
+    uint16_t adc_sampler_average();
+    bool adc_set_filter(uint input, adc_filter_type_t type, uint8_t param);
+    uint16_t adc_value(uint input);
+    void get_adc_sampler_stats(adc_sampler_stats_t *stats);
+    void reset_adc_sampler_stats();
+
 private:
     att_service_handler_t service_handler;
     void custom_service_server_init(char *d_ptr);
@@ -172,9 +388,34 @@ private:
     static int static_custom_service_write_callback(hci_con_handle_t con_handle, uint16_t attribute_handle, uint16_t transaction_mode, uint16_t offset, uint8_t *buffer, uint16_t buffer_size);
     int custom_service_write_callback(hci_con_handle_t con_handle, uint16_t attribute_handle, uint16_t transaction_mode, uint16_t offset, uint8_t *buffer, uint16_t buffer_size);
 
-    static void characteristic_d_callback(void *context);
-
-    void process_received_buffer(char *buffer);
+    char *begin_message(const char *variable, size_t variable_len, bool prefixed, bool coalesce, size_t value_size);
+    void commit_message(char *end);
+    void queue_long(const char *variable, size_t variable_len, bool prefixed, long value);
+    void queue_unsigned_long(const char *variable, size_t variable_len, bool prefixed, unsigned long value);
+    void queue_float(const char *variable, size_t variable_len, bool prefixed, float value);
+    void queue_string(const char *variable, size_t variable_len, bool prefixed, const char *value, bool coalesce);
+    void queue_xyz(const char *variable, size_t variable_len, bool prefixed, float x, float y, float z);
+    bool is_within_deadband(const char *variable, size_t variable_len, float value);
+    void record_deadband(const char *variable, size_t variable_len, float value);
+    void send_queued_messages();
+    bool notify_message_now(const char *variable, const char *value);
+    void clear_outgoing_queue();
+
+    MessageParser<incoming_message_t> message_parser;
+    static incoming_message_t *static_acquire_incoming_message(void *context);
+    static void static_queue_incoming_message(void *context, incoming_message_t *message);
+    void process_incoming_messages();
+    void wake_up();
+
+    void store_labels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4, const char *label5);
+    void store_values(const char *variable, unsigned long time, float *values, uint8_t count);
+    void claim_sd_card();
+    void process_message(char *variable, char *value);
+    bool add_handler(const char *variable, uint8_t type, void (*handler)());
+    bool dispatch_to_handler(uint32_t hash, const char *variable, const char *value);
+
+    void run_link_upgrade();
+    void update_connection_profile();
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,407 @@
+#include "AM_ADCSampler.h"
+
+#include <string.h>
+
+#include "hardware/adc.h"
+#include "hardware/dma.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+
+#define RING_SAMPLES (ADC_SAMPLER_BLOCKS * ADC_SAMPLER_BLOCK_SIZE)
+#define RING_BYTES (RING_SAMPLES * sizeof(uint16_t))
+
+static_assert((RING_SAMPLES & (RING_SAMPLES - 1)) == 0, "ADC_SAMPLER_BLOCKS and ADC_SAMPLER_BLOCK_SIZE must be powers of 2");
+static_assert(RING_BYTES <= 32768, "DMA rings are at most 32 KB");
+static_assert((ADC_FILTER_MAX_WINDOW & (ADC_FILTER_MAX_WINDOW - 1)) == 0, "ADC_FILTER_MAX_WINDOW must be a power of 2");
+
+// Aligned to its size: the DMA write address wraps inside it
+static uint16_t samples_ring[RING_SAMPLES] __attribute__((aligned(RING_BYTES)));
+
+static ADCSampler *irq_sampler;
+
+ADCSampler::ADCSampler()
+{
+    running = false;
+    dma_channels[0] = -1;
+    dma_channels[1] = -1;
+    block_callback = NULL;
+    average = 0;
+    memset(&stats, 0, sizeof(stats));
+    memset(inputs, 0, sizeof(inputs)); // ADC_FILTER_NONE
+    order_len = 0;
+}
+
+/**
+ * Starts sampling input (0 - 3 for GPIO 26 - 29, 4 for the temperature sensor) at sample_rate samples per second.
+ * The GPIO must have been set up with adc_gpio_init(). block_callback can be NULL.
+ * sample_rate goes from ADC_SAMPLER_MIN_RATE to ADC_SAMPLER_MAX_RATE.
+ * Returns false if the sampler is already running, the parameters are out of range or no DMA channels are free.
+ */
+bool ADCSampler::start(uint input, uint32_t sample_rate, adc_block_callback_t block_callback)
+{
+    if (input >= NUM_ADC_CHANNELS)
+    {
+        return false;
+    }
+
+    return start_inputs(1u << input, sample_rate, block_callback);
+}
+
+/**
+ * Samples the inputs in input_mask (bit n for input n) in round robin: sample_rate is shared by the inputs.
+ * The blocks given to block_callback hold the samples interleaved in ascending input order, the first
+ * sample being of the input passed to the callback.
+ */
+bool ADCSampler::start_inputs(uint input_mask, uint32_t sample_rate, adc_block_callback_t block_callback)
+{
+    if (running || input_mask == 0 || input_mask >= (1u << NUM_ADC_CHANNELS) ||
+        sample_rate < ADC_SAMPLER_MIN_RATE || sample_rate > ADC_SAMPLER_MAX_RATE)
+    {
+        return false;
+    }
+
+    dma_channels[0] = dma_claim_unused_channel(false);
+    dma_channels[1] = dma_claim_unused_channel(false);
+    if (dma_channels[0] < 0 || dma_channels[1] < 0)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (dma_channels[i] >= 0)
+            {
+                dma_channel_unclaim(dma_channels[i]);
+            }
+            dma_channels[i] = -1;
+        }
+        return false;
+    }
+
+    this->block_callback = block_callback;
+    average = 0;
+    memset(&stats, 0, sizeof(stats));
+    next_block = 0;
+    irq_sampler = this;
+
+    order_len = 0;
+    for (uint i = 0; i < NUM_ADC_CHANNELS; i++)
+    {
+        inputs[i].history_idx = 0;
+        inputs[i].history_len = 0;
+        inputs[i].iir_valid = false;
+        inputs[i].value = 0;
+        inputs[i].average = 0;
+        if (input_mask & (1u << i))
+        {
+            order[order_len++] = i;
+        }
+    }
+    phase = 0;
+
+    if (input_mask & (1u << ADC_TEMPERATURE_CHANNEL_NUM))
+    {
+        adc_set_temp_sensor_enabled(true);
+    }
+
+    // The round robin starts from the selected input and goes on with the next ones in the mask
+    adc_run(false);
+    adc_select_input(order[0]);
+    adc_set_round_robin(order_len > 1 ? input_mask : 0);
+    adc_fifo_setup(true, true, 1, false, false); // DMA request on each 12 bit sample
+    adc_set_clkdiv(MAX(0.0f, (float)ADC_CLOCK_HZ / sample_rate - 1));
+    adc_fifo_drain();
+
+    for (int i = 0; i < 2; i++)
+    {
+        dma_channel_config config = dma_channel_get_default_config(dma_channels[i]);
+        channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+        channel_config_set_read_increment(&config, false);
+        channel_config_set_write_increment(&config, true);
+        channel_config_set_ring(&config, true, __builtin_ctz(RING_BYTES)); // A channel re-armed late still writes in the ring
+        channel_config_set_dreq(&config, DREQ_ADC);
+        channel_config_set_chain_to(&config, dma_channels[1 - i]);
+
+        channel_block[i] = i;
+        dma_channel_configure(dma_channels[i], &config, &samples_ring[i * ADC_SAMPLER_BLOCK_SIZE], &adc_hw->fifo, ADC_SAMPLER_BLOCK_SIZE, false);
+        dma_channel_set_irq1_enabled(dma_channels[i], true);
+    }
+
+    irq_add_shared_handler(DMA_IRQ_1, &ADCSampler::dma_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_1, true);
+
+    running = true;
+
+    dma_channel_start(dma_channels[0]);
+    adc_run(true);
+
+    return true;
+}
+
+void ADCSampler::stop()
+{
+    if (!running)
+    {
+        return;
+    }
+
+    adc_run(false);
+
+    for (int i = 0; i < 2; i++)
+    {
+        dma_channel_set_irq1_enabled(dma_channels[i], false);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        dma_channel_abort(dma_channels[i]);
+        dma_channel_acknowledge_irq1(dma_channels[i]);
+        dma_channel_unclaim(dma_channels[i]);
+        dma_channels[i] = -1;
+    }
+
+    irq_remove_handler(DMA_IRQ_1, &ADCSampler::dma_irq_handler);
+
+    adc_fifo_setup(false, false, 0, false, false);
+    adc_fifo_drain();
+    adc_set_clkdiv(0);
+    adc_set_round_robin(0);
+
+    running = false;
+}
+
+bool ADCSampler::is_running()
+{
+    return running;
+}
+
+uint16_t ADCSampler::get_average()
+{
+    return average;
+}
+
+uint16_t ADCSampler::get_average(uint input)
+{
+    if (input >= NUM_ADC_CHANNELS)
+    {
+        return 0;
+    }
+
+    return inputs[input].average;
+}
+
+uint ADCSampler::get_input()
+{
+    return order[0];
+}
+
+/**
+ * Sets the filter of input, applied while sampling. param is the window (1 - ADC_FILTER_MAX_WINDOW)
+ * of the moving average and median, the shift (1 - ADC_FILTER_MAX_IIR_SHIFT) of the IIR.
+ * Can be called before start() and while sampling.
+ */
+bool ADCSampler::set_filter(uint input, adc_filter_type_t type, uint8_t param)
+{
+    if (input >= NUM_ADC_CHANNELS)
+    {
+        return false;
+    }
+
+    switch (type)
+    {
+    case ADC_FILTER_NONE:
+        break;
+
+    case ADC_FILTER_MOVING_AVERAGE:
+    case ADC_FILTER_MEDIAN:
+        if (param == 0 || param > ADC_FILTER_MAX_WINDOW)
+        {
+            return false;
+        }
+        break;
+
+    case ADC_FILTER_IIR:
+        if (param == 0 || param > ADC_FILTER_MAX_IIR_SHIFT)
+        {
+            return false;
+        }
+        break;
+
+    default:
+        return false;
+    }
+
+    uint32_t save = save_and_disable_interrupts();
+    inputs[input].filter = type;
+    inputs[input].param = param;
+    inputs[input].iir_valid = false;
+    restore_interrupts(save);
+
+    return true;
+}
+
+uint16_t ADCSampler::get_value(uint input)
+{
+    if (input >= NUM_ADC_CHANNELS)
+    {
+        return 0;
+    }
+
+    return inputs[input].value;
+}
+
+void ADCSampler::get_stats(adc_sampler_stats_t *stats)
+{
+    uint32_t save = save_and_disable_interrupts();
+    *stats = this->stats;
+    restore_interrupts(save);
+}
+
+void ADCSampler::reset_stats()
+{
+    uint32_t save = save_and_disable_interrupts();
+    memset(&stats, 0, sizeof(stats));
+    restore_interrupts(save);
+}
+
+void ADCSampler::dma_irq_handler()
+{
+    ADCSampler *p = irq_sampler;
+
+    // The IRQ is shared: only the channels of the sampler are handled, in the order they filled their blocks
+    while (p->running)
+    {
+        int idx = p->channel_block[0] == p->next_block ? 0 : 1;
+        if (!dma_channel_get_irq1_status(p->dma_channels[idx]))
+        {
+            break;
+        }
+
+        dma_channel_acknowledge_irq1(p->dma_channels[idx]);
+        p->block_filled(idx);
+    }
+}
+
+void ADCSampler::block_filled(int idx)
+{
+    uint8_t block = channel_block[idx];
+    const uint16_t *samples = &samples_ring[block * ADC_SAMPLER_BLOCK_SIZE];
+
+    // Re-armed first: the channel is triggered again when the other one completes its block
+    channel_block[idx] = (block + 2) % ADC_SAMPLER_BLOCKS;
+    dma_channel_set_write_addr(dma_channels[idx], &samples_ring[channel_block[idx] * ADC_SAMPLER_BLOCK_SIZE], false);
+    dma_channel_set_trans_count(dma_channels[idx], ADC_SAMPLER_BLOCK_SIZE, false);
+    next_block = (block + 1) % ADC_SAMPLER_BLOCKS;
+
+    stats.blocks++;
+    if (dma_channel_get_irq1_status(dma_channels[1 - idx]))
+    {
+        stats.overruns++; // The other block is complete too: this channel was triggered before being re-armed
+    }
+
+    // The blocks follow each other without gaps: the round robin goes on from the previous block
+    uint8_t first_input = order[phase];
+    uint32_t sum = 0;
+    uint32_t input_sum[NUM_ADC_CHANNELS] = {0}; // By position in order
+    uint16_t input_count[NUM_ADC_CHANNELS] = {0};
+    for (int i = 0; i < ADC_SAMPLER_BLOCK_SIZE; i++)
+    {
+        sum += samples[i];
+        input_sum[phase] += samples[i];
+        input_count[phase]++;
+
+        add_sample(&inputs[order[phase]], samples[i]);
+        if (++phase == order_len)
+        {
+            phase = 0;
+        }
+    }
+    average = (uint16_t)((sum + ADC_SAMPLER_BLOCK_SIZE / 2) / ADC_SAMPLER_BLOCK_SIZE);
+
+    for (int i = 0; i < order_len; i++)
+    {
+        if (input_count[i] != 0)
+        {
+            inputs[order[i]].average = (uint16_t)((input_sum[i] + input_count[i] / 2) / input_count[i]);
+        }
+        update_value(&inputs[order[i]]);
+    }
+
+    if (block_callback != NULL)
+    {
+        block_callback(samples, ADC_SAMPLER_BLOCK_SIZE, first_input);
+    }
+}
+
+void ADCSampler::add_sample(adc_input_t *input, uint16_t sample)
+{
+    input->history[input->history_idx] = sample;
+    input->history_idx = (input->history_idx + 1) & (ADC_FILTER_MAX_WINDOW - 1);
+    if (input->history_len < ADC_FILTER_MAX_WINDOW)
+    {
+        input->history_len++;
+    }
+
+    // The IIR needs every sample, the other filters only the history
+    if (input->filter == ADC_FILTER_IIR)
+    {
+        if (!input->iir_valid)
+        {
+            input->iir = sample << 8;
+            input->iir_valid = true;
+        }
+        input->iir += ((sample << 8) - input->iir) >> input->param;
+    }
+}
+
+/**
+ * Computes the filtered value once per block, from the last samples of the input
+ */
+void ADCSampler::update_value(adc_input_t *input)
+{
+    if (input->history_len == 0)
+    {
+        return;
+    }
+
+    uint8_t count = MIN(input->param, input->history_len);
+    uint16_t window[ADC_FILTER_MAX_WINDOW];
+    for (uint8_t i = 0; i < count; i++)
+    {
+        window[i] = input->history[(input->history_idx - 1 - i) & (ADC_FILTER_MAX_WINDOW - 1)];
+    }
+
+    switch (input->filter)
+    {
+    case ADC_FILTER_MOVING_AVERAGE:
+    {
+        uint32_t sum = 0;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            sum += window[i];
+        }
+        input->value = (uint16_t)((sum + count / 2) / count);
+        break;
+    }
+
+    case ADC_FILTER_IIR:
+        input->value = (uint16_t)((input->iir + 128) >> 8);
+        break;
+
+    case ADC_FILTER_MEDIAN:
+        // Insertion sort: the window is small
+        for (uint8_t i = 1; i < count; i++)
+        {
+            uint16_t v = window[i];
+            int j = i - 1;
+            while (j >= 0 && window[j] > v)
+            {
+                window[j + 1] = window[j];
+                j--;
+            }
+            window[j + 1] = v;
+        }
+        input->value = window[count / 2];
+        break;
+
+    default:
+        input->value = input->history[(input->history_idx - 1) & (ADC_FILTER_MAX_WINDOW - 1)];
+        break;
+    }
+}
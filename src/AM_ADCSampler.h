@@ -0,0 +1,112 @@
+#ifndef AM_ADCSAMPLER_H
+#define AM_ADCSAMPLER_H
+
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+
+#ifndef ADC_SAMPLER_BLOCK_SIZE
+#define ADC_SAMPLER_BLOCK_SIZE 64 // Samples per block, averaged together (power of 2)
+#endif
+#define ADC_SAMPLER_BLOCKS 4        // Blocks in the DMA ring (power of 2)
+#define ADC_SAMPLER_MAX_RATE 500000 // Samples per second, ADC conversions back to back
+#define ADC_CLOCK_HZ 48000000
+#define ADC_SAMPLER_MIN_RATE (ADC_CLOCK_HZ / 65536 + 1) // Samples per second, the clock divider has a 16 bit integer part
+#define ADC_FILTER_MAX_WINDOW 16    // Max window of the moving average and median filters (power of 2)
+#define ADC_FILTER_MAX_IIR_SHIFT 8  // IIR filter coefficient is 1 / 2^shift
+
+// Called in the DMA interrupt each time a block is filled: it must be short.
+// The block is overwritten ADC_SAMPLER_BLOCKS - 1 blocks later.
+// input is the input of samples[0]: with several inputs the round robin goes on across
+// blocks, so a block starts on any of them when count is not a multiple of their number.
+typedef void (*adc_block_callback_t)(const uint16_t *samples, uint16_t count, uint input);
+
+typedef enum
+{
+    ADC_FILTER_NONE,           // Last sample
+    ADC_FILTER_MOVING_AVERAGE, // Average of the last param samples
+    ADC_FILTER_IIR,            // y += (x - y) / 2^param
+    ADC_FILTER_MEDIAN          // Median of the last param samples
+} adc_filter_type_t;
+
+// ADC sampler statistics
+typedef struct
+{
+    uint32_t blocks;   // Blocks filled
+    uint32_t overruns; // Blocks partially overwritten because the interrupt was served late
+} adc_sampler_stats_t;
+
+/**
+ * Samples one or more ADC inputs in the background at a fixed rate.
+ *
+ * The ADC runs free into its FIFO, and two DMA channels chained to each other move the
+ * samples into a ring of ADC_SAMPLER_BLOCKS blocks: while one channel fills a block the
+ * other is already armed for the next one, so no sample is lost between blocks.
+ * The DMA interrupt averages each block, so get_average() costs no conversion time.
+ *
+ * With several inputs the ADC converts them in round robin, in ascending order. The DMA
+ * interrupt splits the samples into a history per input and filters each input once per
+ * block, so get_value() returns the filtered value at once.
+ */
+class ADCSampler
+{
+public:
+    ADCSampler();
+
+    bool start(uint input, uint32_t sample_rate, adc_block_callback_t block_callback);
+    bool start_inputs(uint input_mask, uint32_t sample_rate, adc_block_callback_t block_callback);
+    void stop();
+    bool is_running();
+
+    // Average of the last block, 0 until the first block is filled.
+    // With several inputs it blends them all: use get_average(input) instead.
+    uint16_t get_average();
+
+    // Average of the samples of input in the last block
+    uint16_t get_average(uint input);
+
+    // First input sampled: the one given to start()
+    uint get_input();
+
+    bool set_filter(uint input, adc_filter_type_t type, uint8_t param);
+
+    // Filtered value of input, 0 until its first block is filled
+    uint16_t get_value(uint input);
+
+    void get_stats(adc_sampler_stats_t *stats);
+    void reset_stats();
+
+private:
+    typedef struct
+    {
+        uint8_t filter; // adc_filter_type_t
+        uint8_t param;
+        uint16_t history[ADC_FILTER_MAX_WINDOW]; // Last samples of the input
+        uint8_t history_idx;                     // Where the next sample goes
+        uint8_t history_len;
+        bool iir_valid;
+        int32_t iir; // IIR output, 8 fractional bits
+        volatile uint16_t value;
+        volatile uint16_t average; // Of its samples in the last block
+    } adc_input_t;
+
+    bool running;
+    adc_input_t inputs[NUM_ADC_CHANNELS];
+    uint8_t order[NUM_ADC_CHANNELS]; // Inputs in conversion order
+    uint8_t order_len;
+    uint8_t phase; // Position in order of the next sample
+    int dma_channels[2];
+    uint8_t channel_block[2]; // Block each channel is filling
+    uint8_t next_block;       // Next block to be filled, in ring order
+    adc_block_callback_t block_callback;
+
+    volatile uint16_t average;
+    adc_sampler_stats_t stats; // Updated by the DMA interrupt
+
+    static void dma_irq_handler();
+    void block_filled(int idx);
+    void add_sample(adc_input_t *input, uint16_t sample);
+    void update_value(adc_input_t *input);
+};
+
+#endif
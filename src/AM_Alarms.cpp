@@ -2,6 +2,7 @@
 #include <time.h>
 
 #include "AM_SDK_PicoBle.h"
+#include "AM_SDManager.h"
 
 #ifdef DUMP_ALARMS
 #define DUMPALARMS_printf printf
@@ -69,7 +70,7 @@ void Alarms::process_alarm_request(char *variable, char *value)
 
     if (strcmp(variable, "$AlarmId$") == 0)
     {
-        strcpy(current_alarm.id, value);
+        snprintf(current_alarm.id, sizeof(current_alarm.id), "%s", value);
     }
     if (strcmp(variable, "$AlarmT$") == 0)
     {
@@ -120,24 +121,56 @@ void Alarms::check_fire_alarms(void (*fireAlarm)(char *))
 
     dumpAlarms();
 
-    for (int i = 0; i < last_alarm_idx; i++)
+    bool changed = false;
+
+    for (int i = 0; i < last_alarm_idx;)
     {
-        if (now >= alarms[i].time)
+        if (now >= (time_t)alarms[i].time)
         {
+            // An alarm overdue for several days fires once
             fireAlarm(alarms[i].id);
+            changed = true;
 
             if (alarms[i].repeat)
             {
-                alarms[i].time += 86400; // Scheduled again tomorrow
+                // Scheduled again at its next occurrence after now
+                alarms[i].time += ((now - alarms[i].time) / 86400 + 1) * 86400;
             }
             else
             {
                 delete_alarm_by_idx(i);
+                continue; // The next alarm is now at i
             }
+        }
+        i++;
+    }
 
-            save_alarms();
+    if (changed)
+    {
+        save_alarms();
+    }
+}
+
+/**
+ * Time of the first alarm to fire, false if there are no alarms
+ */
+bool Alarms::next_alarm_time(time_t *time)
+{
+    if (last_alarm_idx == 0)
+    {
+        return false;
+    }
+
+    *time = alarms[0].time;
+    for (int i = 1; i < last_alarm_idx; i++)
+    {
+        if ((time_t)alarms[i].time < *time)
+        {
+            *time = alarms[i].time;
         }
     }
+
+    return true;
 }
 
 static void delete_alarm_by_id(char *id)
@@ -173,10 +206,9 @@ static int find_alarm(char *alarmId)
 
 static void save_alarms()
 {
-    FATFS fs;
     FIL fil;
 
-    FRESULT fr = f_mount(&fs, "", 1);
+    FRESULT fr = sd_mount();
     if (fr != FR_OK)
     {
         DEBUG_printf("Device not mounted - error: %s (%d)\n", FRESULT_str(fr), fr);
@@ -210,7 +242,7 @@ static void save_alarms()
         DEBUG_printf("f_close error: %s (%d)\n", FRESULT_str(fr), fr);
     }
 
-    f_unmount("");
+    sd_unmount();
 }
 
 static void dumpAlarms()
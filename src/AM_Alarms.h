@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "pico/stdlib.h"
 
 #include "pico/time.h"
@@ -12,7 +13,7 @@
 
 #define ALARM_ID_SIZE 12
 #define MAX_ALARMS 5
-#define ALARMS_CHECKS_PERIOD 10000 // ms
+#define ALARMS_MAX_CHECKS_PERIOD 3600000 // ms, alarms are checked at least this often
 
 typedef struct AM_Alarm
 {
@@ -28,6 +29,7 @@ public:
     void init_alarms();
     void process_alarm_request(char *variable, char *value);
     void check_fire_alarms(void (*processAlarms)(char *));
+    bool next_alarm_time(time_t *time);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,328 @@
+#include "AM_Format.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define FLOAT_DIGITS 5 // Significant digits of "%.5g"
+#define FIXED_SCALE 2  // Decimals of "%.2f"
+
+static const uint64_t powers_of_10[] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+};
+
+#define MAX_POSITIVE_SCALE 11 // mantissa * 10^scale must fit in 64 bits
+#define MAX_NEGATIVE_SCALE 14
+
+/**
+ * Writes the decimal digits of value (no terminator) and returns a pointer past the last digit
+ */
+static char *write_digits(char *buffer, uint64_t value)
+{
+    char digits[20];
+    int n = 0;
+
+    // 64 bit divisions are expensive on Cortex-M0+: use them only when needed
+    while (value > UINT32_MAX)
+    {
+        digits[n++] = '0' + (char)(value % 10);
+        value /= 10;
+    }
+
+    uint32_t value32 = (uint32_t)value;
+    do
+    {
+        digits[n++] = '0' + (char)(value32 % 10);
+        value32 /= 10;
+    } while (value32 != 0);
+
+    while (n > 0)
+    {
+        *buffer++ = digits[--n];
+    }
+
+    return buffer;
+}
+
+/**
+ * Splits a float into |value| = mantissa * 2^exponent.
+ * Returns false for infinities and NaNs.
+ */
+static bool decompose(float value, uint32_t *mantissa, int *exponent, bool *negative)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    int biased_exponent = (bits >> 23) & 0xFF;
+
+    *negative = (bits >> 31) != 0;
+    *mantissa = bits & 0x7FFFFF;
+
+    if (biased_exponent == 0xFF)
+    {
+        return false;
+    }
+
+    if (biased_exponent == 0)
+    {
+        *exponent = -149; // Subnormal
+    }
+    else
+    {
+        *mantissa |= 0x800000;
+        *exponent = biased_exponent - 150;
+    }
+
+    return true;
+}
+
+/**
+ * Computes mantissa * 2^exponent * 10^scale rounded to the nearest integer, ties to even
+ * as printf does. Exact integer arithmetic: returns false when the operands do not fit in 64 bits.
+ */
+static bool scaled_round(uint32_t mantissa, int exponent, int scale, uint64_t *result)
+{
+    uint64_t numerator = mantissa;
+    uint64_t denominator = 1;
+
+    if (scale > MAX_POSITIVE_SCALE || -scale > MAX_NEGATIVE_SCALE)
+    {
+        return false;
+    }
+
+    if (scale >= 0)
+    {
+        numerator *= powers_of_10[scale];
+    }
+    else
+    {
+        denominator = powers_of_10[-scale];
+    }
+
+    if (exponent >= 0)
+    {
+        if (exponent > 62 || (numerator >> (62 - exponent)) != 0)
+        {
+            return false;
+        }
+        numerator <<= exponent;
+    }
+    else if (denominator == 1)
+    {
+        // Division by a power of 2
+        int shift = -exponent;
+        if (shift > 62)
+        {
+            *result = 0; // numerator < 2^61: less than half
+            return true;
+        }
+
+        uint64_t quotient = numerator >> shift;
+        uint64_t remainder = numerator & ((1ULL << shift) - 1);
+        uint64_t half = 1ULL << (shift - 1);
+
+        if (remainder > half || (remainder == half && (quotient & 1)))
+        {
+            quotient++;
+        }
+        *result = quotient;
+        return true;
+    }
+    else
+    {
+        int shift = -exponent;
+        if (shift > 62 || (denominator >> (62 - shift)) != 0)
+        {
+            return false;
+        }
+        denominator <<= shift;
+    }
+
+    uint64_t quotient = numerator / denominator;
+    uint64_t remainder = numerator % denominator;
+
+    if (remainder * 2 > denominator || (remainder * 2 == denominator && (quotient & 1)))
+    {
+        quotient++;
+    }
+    *result = quotient;
+
+    return true;
+}
+
+char *format_long(char *buffer, long value)
+{
+    unsigned long magnitude = (unsigned long)value;
+
+    if (value < 0)
+    {
+        *buffer++ = '-';
+        magnitude = 0UL - magnitude;
+    }
+
+    buffer = write_digits(buffer, magnitude);
+    *buffer = '\0';
+
+    return buffer;
+}
+
+char *format_unsigned_long(char *buffer, unsigned long value)
+{
+    buffer = write_digits(buffer, value);
+    *buffer = '\0';
+
+    return buffer;
+}
+
+char *format_float(char *buffer, float value)
+{
+    uint32_t mantissa;
+    int exponent;
+    bool negative;
+
+    if (!decompose(value, &mantissa, &exponent, &negative))
+    {
+        return buffer + sprintf(buffer, "%.5g", value);
+    }
+
+    char *p = buffer;
+
+    if (negative)
+    {
+        *p++ = '-';
+    }
+
+    if (mantissa == 0)
+    {
+        *p++ = '0';
+        *p = '\0';
+        return p;
+    }
+
+    // Decimal exponent estimated from the position of the leading bit (77/256 ~ log10(2))
+    // and then adjusted on the rounded digits, as %g does
+    int binary_exponent = exponent + 31 - __builtin_clz(mantissa);
+    int decimal_exponent = (binary_exponent * 77) >> 8;
+    uint64_t significand = 0;
+
+    for (int attempt = 0;; attempt++)
+    {
+        if (attempt == 4 || !scaled_round(mantissa, exponent, FLOAT_DIGITS - 1 - decimal_exponent, &significand))
+        {
+            return buffer + sprintf(buffer, "%.5g", value);
+        }
+        if (significand >= powers_of_10[FLOAT_DIGITS])
+        {
+            decimal_exponent++;
+        }
+        else if (significand < powers_of_10[FLOAT_DIGITS - 1])
+        {
+            decimal_exponent--;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    char digits[FLOAT_DIGITS];
+    write_digits(digits, significand);
+
+    // %g drops the trailing zeros
+    int significant_digits = FLOAT_DIGITS;
+    while (significant_digits > 1 && digits[significant_digits - 1] == '0')
+    {
+        significant_digits--;
+    }
+
+    if (decimal_exponent < -4 || decimal_exponent >= FLOAT_DIGITS)
+    {
+        // d.dddde+XX
+        *p++ = digits[0];
+        if (significant_digits > 1)
+        {
+            *p++ = '.';
+            memcpy(p, digits + 1, significant_digits - 1);
+            p += significant_digits - 1;
+        }
+        *p++ = 'e';
+        *p++ = decimal_exponent < 0 ? '-' : '+';
+        int magnitude = decimal_exponent < 0 ? -decimal_exponent : decimal_exponent;
+        if (magnitude < 10)
+        {
+            *p++ = '0';
+        }
+        p = write_digits(p, magnitude);
+    }
+    else if (decimal_exponent >= 0)
+    {
+        // ddd.dd
+        int integer_digits = decimal_exponent + 1;
+        memcpy(p, digits, integer_digits);
+        p += integer_digits;
+        if (significant_digits > integer_digits)
+        {
+            *p++ = '.';
+            memcpy(p, digits + integer_digits, significant_digits - integer_digits);
+            p += significant_digits - integer_digits;
+        }
+    }
+    else
+    {
+        // 0.000ddddd
+        *p++ = '0';
+        *p++ = '.';
+        for (int i = -1; i > decimal_exponent; i--)
+        {
+            *p++ = '0';
+        }
+        memcpy(p, digits, significant_digits);
+        p += significant_digits;
+    }
+
+    *p = '\0';
+
+    return p;
+}
+
+char *format_float_fixed(char *buffer, float value)
+{
+    uint32_t mantissa;
+    int exponent;
+    bool negative;
+    uint64_t hundredths;
+
+    if (!decompose(value, &mantissa, &exponent, &negative) ||
+        !scaled_round(mantissa, exponent, FIXED_SCALE, &hundredths))
+    {
+        return buffer + sprintf(buffer, "%.2f", value);
+    }
+
+    char *p = buffer;
+
+    if (negative)
+    {
+        *p++ = '-';
+    }
+
+    p = write_digits(p, hundredths / 100);
+    *p++ = '.';
+    *p++ = '0' + (char)((hundredths / 10) % 10);
+    *p++ = '0' + (char)(hundredths % 10);
+    *p = '\0';
+
+    return p;
+}
@@ -0,0 +1,18 @@
+#ifndef AM_FORMAT_H
+#define AM_FORMAT_H
+
+#include <stdint.h>
+
+// Max number of characters written by any of the functions below, terminating '\0' included
+#define FORMAT_MAX_SIZE 48
+
+// Allocation-free replacements of sprintf for the formats used by the protocol.
+// The output is byte-identical to sprintf. Each function writes a '\0' terminated
+// string into buffer (at least FORMAT_MAX_SIZE bytes) and returns a pointer to the '\0'.
+
+char *format_long(char *buffer, long value);                   // "%ld" ("%d")
+char *format_unsigned_long(char *buffer, unsigned long value); // "%lu"
+char *format_float(char *buffer, float value);                 // "%.5g"
+char *format_float_fixed(char *buffer, float value);           // "%.2f"
+
+#endif
@@ -0,0 +1,158 @@
+#ifndef AM_PARSER_H
+#define AM_PARSER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * <variable>=<value> message with bounded storage: append_* refuse
+ * characters beyond VARIABLE_LEN / VALUE_LEN instead of overflowing.
+ */
+template <size_t VARIABLE_LEN, size_t VALUE_LEN>
+struct ParsedMessage
+{
+    static_assert(VARIABLE_LEN > 0 && VARIABLE_LEN < UINT16_MAX, "Invalid variable length");
+    static_assert(VALUE_LEN > 0 && VALUE_LEN < UINT16_MAX, "Invalid value length");
+
+    char variable[VARIABLE_LEN + 1];
+    char value[VALUE_LEN + 1];
+    uint16_t variable_len;
+    uint16_t value_len;
+
+    void clear()
+    {
+        variable_len = 0;
+        value_len = 0;
+        variable[0] = '\0';
+        value[0] = '\0';
+    }
+
+    bool append_variable(char c)
+    {
+        if (variable_len == VARIABLE_LEN)
+        {
+            return false;
+        }
+        variable[variable_len++] = c;
+        variable[variable_len] = '\0';
+        return true;
+    }
+
+    bool append_value(char c)
+    {
+        if (value_len == VALUE_LEN)
+        {
+            return false;
+        }
+        value[value_len++] = c;
+        value[value_len] = '\0';
+        return true;
+    }
+};
+
+/**
+ * Incremental parser of the <variable>=<value># messages received from the device.
+ *
+ * Bytes are consumed one at a time as the writes arrive, so a message can be split
+ * anywhere across writes and nothing is scanned twice. Each message is parsed in place
+ * into the storage returned by the acquire callback, and passed to the complete callback
+ * as soon as its # is received.
+ * Messages longer than the storage, and messages for which no storage is available,
+ * are discarded up to the next #. Parts without = are ignored and NUL bytes are skipped.
+ */
+template <typename MESSAGE>
+class MessageParser
+{
+public:
+    typedef MESSAGE *(*acquire_callback_t)(void *context); // Storage of the next message, NULL if none
+    typedef void (*complete_callback_t)(void *context, MESSAGE *message);
+
+    void init(acquire_callback_t acquire, complete_callback_t complete, void *context)
+    {
+        this->acquire = acquire;
+        this->complete = complete;
+        this->context = context;
+        overflows = 0;
+        reset();
+    }
+
+    // Discards a partially received message
+    void reset()
+    {
+        state = PARSING_VARIABLE;
+        message = NULL;
+    }
+
+    void parse(const uint8_t *data, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            char c = (char)data[i];
+
+            if (c == '#')
+            {
+                if (state == PARSING_VALUE)
+                {
+                    complete(context, message);
+                }
+                reset();
+            }
+            else if (c == '\0' || state == DISCARDING)
+            {
+                continue;
+            }
+            else if (message == NULL && !start_message())
+            {
+                state = DISCARDING;
+            }
+            else if (c == '=' && state == PARSING_VARIABLE)
+            {
+                state = PARSING_VALUE;
+            }
+            else if (state == PARSING_VARIABLE ? !message->append_variable(c) : !message->append_value(c))
+            {
+                overflows++;
+                state = DISCARDING;
+            }
+        }
+    }
+
+    // Number of messages discarded because longer than the storage
+    uint32_t get_overflows() const
+    {
+        return overflows;
+    }
+
+    void clear_overflows()
+    {
+        overflows = 0;
+    }
+
+private:
+    enum
+    {
+        PARSING_VARIABLE,
+        PARSING_VALUE,
+        DISCARDING
+    } state;
+
+    MESSAGE *message; // Message being parsed, NULL until its first character
+    uint32_t overflows;
+
+    acquire_callback_t acquire;
+    complete_callback_t complete;
+    void *context;
+
+    bool start_message()
+    {
+        message = acquire(context);
+        if (message == NULL)
+        {
+            return false;
+        }
+        message->clear();
+        return true;
+    }
+};
+
+#endif
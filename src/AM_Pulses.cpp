@@ -0,0 +1,131 @@
+#include "AM_Pulses.h"
+
+#include <string.h>
+
+#include "hardware/sync.h"
+
+PulseGenerator::PulseGenerator()
+{
+    memset(pulses, 0, sizeof(pulses));
+}
+
+/**
+ * Returns false if on_ms is 0, if a train has no gap between the pulses, or if MAX_PULSES pins are already pulsing.
+ * A pin already pulsing is restarted, and gets back the level it had before the first pulse at the end.
+ */
+bool PulseGenerator::start(uint pin, bool value, uint32_t on_ms, uint32_t off_ms, uint16_t count)
+{
+    if (on_ms == 0 || (count != 1 && off_ms == 0))
+    {
+        return false;
+    }
+
+    // The alarm callback runs in the timer interrupt on this core
+    uint32_t save = save_and_disable_interrupts();
+
+    bool rest_value;
+    pulse_t *p = find_pulse(pin);
+    if (p != NULL)
+    {
+        cancel_alarm(p->alarm);
+        rest_value = p->rest_value;
+    }
+    else
+    {
+        for (int i = 0; i < MAX_PULSES && p == NULL; i++)
+        {
+            if (!pulses[i].active)
+            {
+                p = &pulses[i];
+            }
+        }
+
+        if (p == NULL)
+        {
+            restore_interrupts(save);
+            return false;
+        }
+
+        rest_value = gpio_get(pin);
+    }
+
+    p->pin = pin;
+    p->value = value;
+    p->rest_value = rest_value;
+    p->on = true;
+    p->on_us = on_ms * 1000ull;
+    p->off_us = off_ms * 1000ull;
+    p->remaining = count;
+
+    gpio_put(pin, value);
+    p->alarm = add_alarm_in_us(p->on_us, &PulseGenerator::alarm_callback, p, true);
+    p->active = p->alarm > 0;
+    if (!p->active)
+    {
+        gpio_put(pin, rest_value); // No timer left in the alarm pool
+    }
+
+    restore_interrupts(save);
+
+    return p->active;
+}
+
+bool PulseGenerator::stop(uint pin)
+{
+    uint32_t save = save_and_disable_interrupts();
+
+    pulse_t *p = find_pulse(pin);
+    if (p != NULL)
+    {
+        cancel_alarm(p->alarm);
+        gpio_put(pin, p->rest_value);
+        p->active = false;
+    }
+
+    restore_interrupts(save);
+
+    return p != NULL;
+}
+
+bool PulseGenerator::is_active(uint pin)
+{
+    return find_pulse(pin) != NULL;
+}
+
+PulseGenerator::pulse_t *PulseGenerator::find_pulse(uint pin)
+{
+    for (int i = 0; i < MAX_PULSES; i++)
+    {
+        if (pulses[i].active && pulses[i].pin == pin)
+        {
+            return &pulses[i];
+        }
+    }
+
+    return NULL;
+}
+
+int64_t PulseGenerator::alarm_callback(__unused alarm_id_t id, void *user_data)
+{
+    pulse_t *p = (pulse_t *)user_data;
+
+    // A negative return value reschedules the alarm from its previous deadline, a positive one from now
+    if (p->on)
+    {
+        gpio_put(p->pin, p->rest_value);
+        p->on = false;
+
+        if (p->remaining != 0 && --p->remaining == 0)
+        {
+            p->active = false;
+            return 0;
+        }
+
+        return -(int64_t)p->off_us;
+    }
+
+    gpio_put(p->pin, p->value);
+    p->on = true;
+
+    return -(int64_t)p->on_us;
+}
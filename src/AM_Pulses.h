@@ -0,0 +1,50 @@
+#ifndef AM_PULSES_H
+#define AM_PULSES_H
+
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+
+#define MAX_PULSES 8 // Pins pulsing at the same time, each one uses a timer of the default alarm pool
+
+/**
+ * Drives GPIO pulses and pulse trains from the default alarm pool, without blocking the caller.
+ *
+ * Each pin pulsing has its own one-shot alarm: the alarm callback switches the pin and
+ * reschedules itself relative to its previous deadline, so the edges of a pulse train do not drift.
+ * Methods must be called from the core that owns the default alarm pool (core 0).
+ */
+class PulseGenerator
+{
+public:
+    PulseGenerator();
+
+    // count pulses at value for on_ms, separated by off_ms; count 0 pulses until stop()
+    bool start(uint pin, bool value, uint32_t on_ms, uint32_t off_ms, uint16_t count);
+
+    // Stops the pulses and restores the level the pin had before them
+    bool stop(uint pin);
+
+    bool is_active(uint pin);
+
+private:
+    typedef struct
+    {
+        volatile bool active;
+        uint pin;
+        bool value;      // Level during the pulses
+        bool rest_value; // Level between and after the pulses
+        bool on;         // In a pulse
+        uint64_t on_us;
+        uint64_t off_us;
+        uint16_t remaining; // Pulses not yet completed, 0 if the train runs until stop()
+        alarm_id_t alarm;
+    } pulse_t;
+
+    pulse_t pulses[MAX_PULSES];
+
+    pulse_t *find_pulse(uint pin);
+    static int64_t alarm_callback(alarm_id_t id, void *user_data);
+};
+
+#endif
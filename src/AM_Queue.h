@@ -0,0 +1,78 @@
+#ifndef AM_QUEUE_H
+#define AM_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * Lock-free ring of N items (N power of 2) with a single producer and a single consumer,
+ * for instance an interrupt handler and the main loop, or the two cores.
+ *
+ * Items are filled and consumed in place:
+ *
+ *     T *item = queue.back();      // producer, NULL if full
+ *     ... fill item ...
+ *     queue.push();
+ *
+ *     T *item = queue.front();     // consumer, NULL if empty
+ *     ... use item ...
+ *     queue.pop();
+ */
+template <typename T, size_t N>
+class SPSCQueue
+{
+    static_assert(N > 0 && (N & (N - 1)) == 0, "Queue size must be a power of 2");
+
+public:
+    SPSCQueue() : head(0), tail(0)
+    {
+    }
+
+    // Producer side
+
+    T *back()
+    {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) == N)
+        {
+            return NULL;
+        }
+        return &items[h & (N - 1)];
+    }
+
+    void push()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer side
+
+    T *front()
+    {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == t)
+        {
+            return NULL;
+        }
+        return &items[t & (N - 1)];
+    }
+
+    void pop()
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Approximate if called while the other side is running
+    size_t count() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+private:
+    T items[N];
+    std::atomic<uint32_t> head; // Written by the producer only
+    std::atomic<uint32_t> tail; // Written by the consumer only
+};
+
+#endif
@@ -1,5 +1,7 @@
 #include "AM_SDK_PicoBle.h"
 
+#include <math.h>
+
 #include "pico/cyw43_arch.h"
 #include "btstack.h"
 #include "pico/time.h"
@@ -11,6 +13,9 @@
 
 #include "gap_configuration.h"
 
+#include "AM_Format.h"
+#include "AM_SDManager.h"
+
 // Global instance for forwarding
 AMController *global_instance = nullptr;
 
@@ -34,6 +39,153 @@ static uint8_t adv_data[] = {
 
 static const uint8_t adv_data_len = sizeof(adv_data);
 
+#define WORK_PERIOD_MS 500 // Default doWork and processOutgoingMessages period
+
+// FNV-1a hash of the protocol verbs, usable in case labels
+static constexpr uint32_t verb_hash(const char *verb)
+{
+    uint32_t hash = 2166136261u;
+    while (*verb != '\0')
+    {
+        hash = (hash ^ (uint8_t)*verb++) * 16777619u;
+    }
+    return hash;
+}
+
+// Link upgrade steps requested after the connection
+#define LINK_UPGRADE_DATA_LENGTH 0x01
+#define LINK_UPGRADE_PHY 0x02
+
+// Max link layer payload (octets) and the time needed to transmit it on LE 1M (us)
+#define LE_MAX_TX_OCTETS 251
+#define LE_MAX_TX_TIME 2120
+
+#define LE_PHY_1M 1
+#define LE_PHY_2M_MASK 0x02
+
+// Connection parameters for each connection_profile_t (within Apple's Accessory Design Guidelines)
+typedef struct
+{
+    uint16_t interval_min;        // 1.25 ms units
+    uint16_t interval_max;        // 1.25 ms units
+    uint16_t latency;             // Connection events
+    uint16_t supervision_timeout; // 10 ms units
+} connection_parameters_t;
+
+static const connection_parameters_t connection_parameters[] = {
+    {0, 0, 0, 0},      // CONNECTION_PROFILE_DEFAULT (not requested)
+    {12, 24, 0, 400},  // CONNECTION_PROFILE_LOW_LATENCY
+    {24, 48, 0, 400},  // CONNECTION_PROFILE_BALANCED
+    {80, 160, 4, 500}, // CONNECTION_PROFILE_LOW_POWER
+};
+
+// Outgoing messages are queued by the write_message family and,
+// on each ATT_EVENT_CAN_SEND_NOW, packed into a single notification up to the ATT MTU.
+// Each pending frame is also the slot of its variable: a new value for a variable
+// still waiting to be sent overwrites the slot in place (last value wins).
+
+typedef struct
+{
+    uint16_t len;
+    uint16_t variable_len; // Length of the variable name at the start of text, 0 if the frame cannot be coalesced
+    char text[OUTGOING_FRAME_SIZE];
+} outgoing_frame_t;
+
+// queue_long() and queue_float() reserve FORMAT_MAX_SIZE bytes after the name
+static_assert(VARIABLELEN + 1 + FORMAT_MAX_SIZE <= OUTGOING_FRAME_SIZE, "A number does not fit an outgoing frame");
+static_assert(OUTGOING_FRAME_SIZE < UINT16_MAX, "Outgoing frame too long");
+
+static outgoing_frame_t outgoing_frames[OUTGOING_QUEUE_SIZE];
+static uint8_t notification_buffer[ATT_MAX_PAYLOAD_SIZE]; // Pending frames packed into a single notification
+static outgoing_frame_t *writing_frame;                    // Frame reserved by begin_message()
+static uint16_t outgoing_head;                             // Index of the next message to send
+static uint16_t outgoing_count;                            // Number of messages waiting to be sent
+static outgoing_queue_stats_t outgoing_stats;
+
+// SD card writes of the logs, run on core 1 after set_sd_on_core1()
+static SDWorker sd_worker;
+
+// Parts of a long write, received with Prepare Write and parsed on Execute Write
+static uint8_t long_write_buffer[LONG_WRITE_SIZE];
+static uint16_t long_write_len;
+static hci_con_handle_t long_write_con_handle; // Connection the parts were received on
+
+// Numeric values within the deadband of the last value sent are not sent again
+
+typedef struct
+{
+    char variable[VARIABLELEN + 1];
+    uint16_t variable_len; // 0 if the entry is free
+    float absolute;       // Max absolute change ignored
+    float relative;       // Max change ignored, as a fraction of the last value sent
+    uint32_t refresh_ms;  // The value is sent anyway after this time (0 = never)
+    bool has_last;        // last_value has been sent on the current connection
+    float last_value;
+    uint32_t last_time_ms;
+} deadband_t;
+
+static deadband_t deadbands[MAX_DEADBANDS];
+
+static deadband_t *find_deadband(const char *variable, size_t variable_len);
+static void reset_deadbands();
+
+// Handlers registered for the incoming messages of a variable, sorted by hash of the variable
+
+typedef enum
+{
+    HANDLER_BOOL,
+    HANDLER_LONG,
+    HANDLER_FLOAT,
+    HANDLER_STRING,
+    HANDLER_XYZ
+} handler_type_t;
+
+typedef struct
+{
+    uint32_t hash;
+    char variable[VARIABLELEN + 1];
+    uint8_t type;       // handler_type_t: how the value is parsed and the real type of handler
+    void (*handler)(); // Cast back to its real type before being called
+} message_handler_t;
+
+static message_handler_t message_handlers[MAX_MESSAGE_HANDLERS];
+static int message_handlers_count;
+
+#if PICO_CYW43_ARCH_POLL
+// Does nothing: being pending ends cyw43_arch_wait_for_work_until() (see AMController::wake_up())
+static void wake_up_worker_do_work(__unused async_context_t *context, __unused async_when_pending_worker_t *worker)
+{
+}
+
+static async_when_pending_worker_t wake_up_worker;
+#endif
+
+// The queue is filled from the main loop and drained from the BTstack context
+static inline void lock_outgoing_queue()
+{
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+}
+
+static inline void unlock_outgoing_queue()
+{
+    async_context_release_lock(cyw43_arch_async_context());
+}
+
+AMController::AMController()
+{
+    coalesce_messages = true;
+    link_upgrade = false;
+    auto_connection_profile = false;
+    idle_connection_profile = CONNECTION_PROFILE_LOW_POWER;
+    work_period_ms = WORK_PERIOD_MS;
+    sd_on_core1 = false;
+    low_power_idle = false;
+    wake_up_ready = false;
+
+    // The logs can be written before init(), e.g. their labels
+    sd_manager = new SDManager(this);
+}
+
 void AMController::init(
     void (*doWork)(void),
     void (*doSync)(void),
@@ -55,6 +207,29 @@ void AMController::init(
 
     is_device_connected = false;
     is_sync_completed = false;
+    att_mtu = ATT_DEFAULT_MTU;
+    link_upgrade_pending = 0;
+    memset(&link_status, 0, sizeof(link_status));
+    connection_profile = CONNECTION_PROFILE_DEFAULT;
+
+    clear_outgoing_queue();
+    memset(&outgoing_stats, 0, sizeof(outgoing_stats));
+    reset_deadbands();
+
+    memset(&incoming_stats, 0, sizeof(incoming_stats));
+    message_parser.init(&AMController::static_acquire_incoming_message, &AMController::static_queue_incoming_message, this);
+    sem_init(&wake_up_sem, 0, 1);
+    work_requested = false;
+    alarms_enabled = false;
+    time_set = false;
+    alarms_check_alarm = 0;
+    alarms_check_due = false;
+    memset(&idle_stats, 0, sizeof(idle_stats));
+#if PICO_CYW43_ARCH_POLL
+    wake_up_worker.do_work = wake_up_worker_do_work;
+    async_context_add_when_pending_worker(cyw43_arch_async_context(), &wake_up_worker);
+#endif
+    wake_up_ready = true;
 
     l2cap_init();
     sm_init();
@@ -86,10 +261,7 @@ void AMController::init(
     // -----------------------------------
     sleep_ms(100); // Wait a while before configuring the SD Card
 
-    sd_manager = new SDManager(this);
-
-    FATFS fs;
-    FRESULT fr = f_mount(&fs, "", 1);
+    FRESULT fr = sd_mount();
     if (FR_OK == fr)
     {
         printf("SD Card mounted!\n");
@@ -97,43 +269,70 @@ void AMController::init(
         {
             // Initialize Alarms
             alarms.init_alarms();
-            add_repeating_timer_ms(ALARMS_CHECKS_PERIOD, this->alarm_timer_callback, this, &alarms_checks_timer);
+            alarms_enabled = true;
+            schedule_alarms_check();
         }
+        sd_unmount();
     }
     else
     {
         printf("Error: SD not mounted!\n");
     }
 
-    f_unmount("");
+
+    if (sd_on_core1)
+    {
+        sd_worker.start(sd_manager);
+    }
+
     send_dir = false;
     send_log_file = false;
     send_file_content = false;
     file_to_send[0] = '\0';
-    already_read_bytes = 0;
 
+    absolute_time_t next_work_time = get_absolute_time();
+    uint64_t busy_start = time_us_64();
+
+    // Event loop: each pass handles what is due, then the loop sleeps until the next
+    // deadline (doWork or a task) or until wake_up() is called by a received message, a connection,
+    // ATT_EVENT_CAN_SEND_NOW during a transfer, the alarms timer or request_work()
     while (true)
     {
+        process_incoming_messages();
+
+        sd_worker.process_completions();
+
+        if (alarms_check_due)
+        {
+            alarms_check_due = false;
+            claim_sd_card();
+            alarms.check_fire_alarms(processAlarms);
+            schedule_alarms_check();
+        }
+
+        if (send_log_file || send_dir || send_file_content)
+        {
+            claim_sd_card();
+        }
+
         if (send_log_file)
         {
             DEBUG_printf("Sending Logging file: %s\n", file_to_send);
-            int ret = sd_manager->sd_send_log_data(file_to_send, &already_read_bytes);
+            int ret = sd_manager->sd_send_log_data(file_to_send);
             if (ret == 0)
             {
                 send_log_file = false;
                 file_to_send[0] = '\0';
-                already_read_bytes = 0;
             }
         }
 
         if (send_dir)
         {
-            DEBUG_printf("Sending File List [last sent %s]\n", file_to_send);
-            int ret = sd_manager->dir(file_to_send);
+            DEBUG_printf("Sending File List\n");
+            int ret = sd_manager->dir();
             if (ret == 0)
             {
                 file_to_send[0] = '\0';
-                already_read_bytes = 0;
                 send_dir = false;
             }
         }
@@ -141,38 +340,94 @@ void AMController::init(
         if (send_file_content)
         {
             DEBUG_printf("Sending Content of File %s\n", file_to_send);
-            int ret = sd_manager->transmit_file(file_to_send, &already_read_bytes);
+            int ret = sd_manager->transmit_file(file_to_send);
             if (ret == 0)
             {
                 send_file_content = false;
                 file_to_send[0] = '\0';
-                already_read_bytes = 0;
             }
         }
 
-        doWork();
+        update_connection_profile();
 
-        if (is_device_connected & is_sync_completed)
+        bool transferring = send_dir || send_log_file || send_file_content;
+
+        if (!transferring && sd_manager->is_transferring())
         {
-            if (!send_dir && !send_log_file && !send_file_content)
+            // Stopped by a disconnection: the file is still open
+            claim_sd_card();
+            sd_manager->cancel_transfer();
+        }
+
+        scheduler.run_due_tasks();
+
+        // With low power idle doWork runs periodically only while a device is connected
+        bool work_periodic = !low_power_idle || is_device_connected;
+
+        if (work_requested || (work_periodic && time_reached(next_work_time)))
+        {
+            work_requested = false;
+            if (doWork != NULL)
+            {
+                doWork();
+            }
+
+            if (is_device_connected & is_sync_completed)
             {
-                processOutgoingMessages();
+                if (!transferring)
+                {
+                    processOutgoingMessages();
+                }
             }
+
+            next_work_time = make_timeout_time_ms(work_period_ms);
+        }
+
+        absolute_time_t wake_up_time = scheduler.next_deadline();
+
+        absolute_time_t mtu_deadline;
+        if (transferring && sd_manager->is_waiting_mtu(&mtu_deadline))
+        {
+            // Resumed by ATT_EVENT_MTU_EXCHANGE_COMPLETE, or when the wait ends
+            wake_up_time = absolute_time_min(wake_up_time, mtu_deadline);
+        }
+        else if (transferring)
+        {
+            // The transfer is resumed as soon as BTstack can send again (ATT_EVENT_CAN_SEND_NOW)
+            async_context_acquire_lock_blocking(cyw43_arch_async_context());
+            att_server_request_can_send_now_event(service_object.con_handle);
+            async_context_release_lock(cyw43_arch_async_context());
+        }
+        if (work_periodic)
+        {
+            wake_up_time = absolute_time_min(wake_up_time, next_work_time);
         }
 
+        uint64_t idle_start = time_us_64();
+        idle_stats.busy_us += idle_start - busy_start;
+
 #if PICO_CYW43_ARCH_POLL
         // if you are using pico_cyw43_arch_poll, then you must poll periodically from your
         // main loop (not from a timer) to check for Wi-Fi driver or lwIP work that needs to be done.
         cyw43_arch_poll();
         // you can poll as often as you like, however if you have nothing else to do you can
-        // choose to sleep until either a specified time, or cyw43_arch_poll() has work to do:
-        cyw43_arch_wait_for_work_until(make_timeout_time_ms(1000));
+        // choose to sleep until either a specified time, or cyw43_arch_poll() has work to do.
+        // Work queued by cyw43_arch_poll() itself is handled right away
+        if (!sem_try_acquire(&wake_up_sem))
+        {
+            cyw43_arch_wait_for_work_until(wake_up_time);
+        }
 #else
         // if you are not using pico_cyw43_arch_poll, then WiFI driver and lwIP work
-        // is done via interrupt in the background. This sleep is just an example of some (blocking)
-        // work you might be doing.
-        sleep_ms(500);
+        // is done via interrupt in the background.
+        sem_acquire_block_until(&wake_up_sem, wake_up_time);
 #endif
+
+        busy_start = time_us_64();
+        uint64_t idle_us = busy_start - idle_start;
+        idle_stats.idle_us += idle_us;
+        idle_stats.max_idle_us = MAX(idle_stats.max_idle_us, idle_us);
+        idle_stats.wakeups++;
     }
 }
 
@@ -244,9 +499,28 @@ int AMController::static_custom_service_write_callback(hci_con_handle_t con_hand
 
 int AMController::custom_service_write_callback(hci_con_handle_t con_handle, uint16_t attribute_handle, uint16_t transaction_mode, uint16_t offset, uint8_t *received_buffer, uint16_t received_buffer_size)
 {
-    UNUSED(transaction_mode);
-    UNUSED(offset);
-    UNUSED(received_buffer_size);
+    // Execute Write is signalled to every service with attribute handle 0: only the connection identifies the long write
+    switch (transaction_mode)
+    {
+    case ATT_TRANSACTION_MODE_VALIDATE:
+        return 0;
+
+    case ATT_TRANSACTION_MODE_EXECUTE:
+        if (long_write_len > 0 && con_handle == long_write_con_handle)
+        {
+            DEBUG_printf("R long >%.*s< [%d]\n", (int)long_write_len, long_write_buffer, long_write_len);
+            message_parser.parse(long_write_buffer, long_write_len);
+            long_write_len = 0;
+        }
+        return 0;
+
+    case ATT_TRANSACTION_MODE_CANCEL:
+        if (con_handle == long_write_con_handle)
+        {
+            long_write_len = 0;
+        }
+        return 0;
+    }
 
     // Enable/disable notificatins
     if (attribute_handle == service_object.characteristic_d_client_configuration_handle)
@@ -258,61 +532,41 @@ int AMController::custom_service_write_callback(hci_con_handle_t con_handle, uin
     // Write characteristic value
     if (attribute_handle == service_object.characteristic_d_handle)
     {
-        custom_service_t *instance = &service_object;
-        received_buffer[received_buffer_size] = 0;
-
-        int len = 0;
-        for(int i=0; i<received_buffer_size; i++) {
-            if (received_buffer[i] == '\0') {
-                break;
+        switch (transaction_mode)
+        {
+        case ATT_TRANSACTION_MODE_ACTIVE:
+            // Prepare Write: the parts of a long write are reassembled and parsed on Execute Write
+            if (offset == 0)
+            {
+                long_write_len = 0; // A new long write: the parts of one never executed are dropped
             }
-            len++;            
-        }
-        
-        if (received_buffer[len-1] != '#') {
-            DEBUG_printf("R >%s< [%d]\n",received_buffer,len);
-            strcat(service_object.buffer,(char *)received_buffer);
-            return 0;
-        }
-
-        strcat(service_object.buffer,(char *)received_buffer);
-
-        //memset(service_object.characteristic_d_value, 0, sizeof(service_object.characteristic_d_value));
-        //memcpy(service_object.characteristic_d_value, received_buffer, received_buffer_size);
-
-        // Null-terminate the string
-        //service_object.characteristic_d_value[received_buffer_size] = 0;
-
-        strcpy(service_object.characteristic_d_value, service_object.buffer);
-        service_object.buffer[0] = '\0';
-
-        DEBUG_printf("R >%s<\n", service_object.characteristic_d_value);
+            if (offset > long_write_len)
+            {
+                long_write_len = 0;
+                return ATT_ERROR_INVALID_OFFSET;
+            }
+            if (offset + received_buffer_size > LONG_WRITE_SIZE)
+            {
+                long_write_len = 0;
+                return ATT_ERROR_PREPARE_QUEUE_FULL;
+            }
+            memcpy(long_write_buffer + offset, received_buffer, received_buffer_size);
+            long_write_len = MAX(long_write_len, offset + received_buffer_size);
+            long_write_con_handle = con_handle;
+            break;
 
-        // Buffer is processed only if the buffer is something like <variable>=<value>#
-        process_received_buffer(service_object.characteristic_d_value);
+        default:
+            DEBUG_printf("R >%.*s< [%d]\n", received_buffer_size, received_buffer, received_buffer_size);
 
-        // If client has enabled notifications, register a callback
-        if (instance->characteristic_d_client_configuration)
-        {
-            instance->callback_d.callback = &characteristic_d_callback;
-            instance->callback_d.context = (void *)instance;
-            // att_server_register_can_send_now_callback(&instance->callback_d, instance->con_handle);
+            // Messages can be split across several writes: each one is processed as soon as its # is received
+            message_parser.parse(received_buffer, received_buffer_size);
+            break;
         }
-        // Alert the application of a bluetooth RX
-        // PT_SEM_SAFE_SIGNAL(pt, &BLUETOOTH_READY);
     }
 
     return 0;
 }
 
-void AMController::characteristic_d_callback(void *context)
-{
-    // Associate the void pointer input with our custom service object
-    custom_service_t *instance = (custom_service_t *)context;
-    // Send a notification
-    att_server_notify(instance->con_handle, instance->characteristic_d_handle, reinterpret_cast<uint8_t *>(instance->characteristic_d_value), strlen(instance->characteristic_d_value));
-}
-
 void AMController::static_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
 {
     if (global_instance)
@@ -359,25 +613,47 @@ void AMController::packet_handler(uint8_t packet_type, uint16_t channel, uint8_t
     case ATT_EVENT_CONNECTED:
         DEBUG_printf("ATT_EVENT_CONNECTED\n");
         is_device_connected = true;
+        service_object.con_handle = att_event_connected_get_handle(packet);
+        att_mtu = ATT_DEFAULT_MTU;
+        link_status.max_tx_octets = 27;
+        link_status.max_rx_octets = 27;
+        link_status.tx_phy = LE_PHY_1M;
+        link_status.rx_phy = LE_PHY_1M;
+        connection_profile = CONNECTION_PROFILE_DEFAULT;
+        if (link_upgrade)
+        {
+            link_upgrade_pending = LINK_UPGRADE_DATA_LENGTH | LINK_UPGRADE_PHY;
+        }
         if (deviceConnected != NULL)
         {
             deviceConnected();
         }
+        wake_up(); // doWork runs periodically again in low power idle
         break;
 
     case ATT_EVENT_DISCONNECTED:
         DEBUG_printf("ATT_EVENT_DISCONNECTED\n");
         is_device_connected = false;
+        att_mtu = ATT_DEFAULT_MTU;
+        link_upgrade_pending = 0;
+        memset(&link_status, 0, sizeof(link_status));
+        connection_profile = CONNECTION_PROFILE_DEFAULT;
+        is_sync_completed = false;
+        service_object.characteristic_d_client_configuration = 0; // Nothing is queued until the next device enables notifications
+        clear_outgoing_queue();
+        reset_deadbands();
+        message_parser.reset();
+        long_write_len = 0;
         // Just in case ...
         send_dir = false;
         send_file_content = false;
         send_log_file = false;
-        already_read_bytes = 0;
         file_to_send[0] = '\0';
         if (deviceDisconnected != NULL)
         {
             deviceDisconnected();
         }
+        wake_up();
         break;
 
         // Disconnected from a client
@@ -385,323 +661,1156 @@ void AMController::packet_handler(uint8_t packet_type, uint16_t channel, uint8_t
         // printf("HCI_EVENT_DISCONNECTION_COMPLETE \n");
         break;
 
+    // The device negotiated a larger MTU: larger notifications and file chunks can be sent
+    case ATT_EVENT_MTU_EXCHANGE_COMPLETE:
+        att_mtu = att_event_mtu_exchange_complete_get_MTU(packet);
+        DEBUG_printf("ATT_EVENT_MTU_EXCHANGE_COMPLETE MTU: %d\n", att_mtu);
+        wake_up(); // Resumes a log transfer waiting for a larger MTU
+        break;
+
     // Ready to send ATT
     case ATT_EVENT_CAN_SEND_NOW:
         DEBUG_printf("ATT_EVENT_CAN_SEND_NOW\n");
+        send_queued_messages();
+        wake_up(); // Resumes a file transfer waiting for this event
         break;
 
-    default:
-        break;
-    }
-}
-
-void AMController::process_received_buffer(char *buffer)
-{
-    DEBUG_printf("Buffer >>>%s<<<\n", buffer);
-
-    char *pHash;
-
-    pHash = strtok(buffer, "#");
-    while (pHash != NULL)
-    {
-        DEBUG_printf("\t>%s<\n", pHash);
-        char buffer1[strlen(pHash) + 1];
-        strcpy(buffer1, pHash);
-
-        char variable[VARIABLELEN];
-        char value[VALUELEN];
-
-        char *pEqual = strchr(pHash, '=');
-        if (pEqual != NULL)
+    // Outcome of the link upgrade
+    case HCI_EVENT_LE_META:
+        switch (hci_event_le_meta_get_subevent_code(packet))
         {
-            strncpy(variable, pHash, MIN(VARIABLELEN, pEqual - pHash));
-            variable[pEqual - pHash] = '\0';
-            strncpy(value, pEqual + 1, VALUELEN);
-
-            // DEBUG_printf("\t\tvariable %s - value: %s\n", variable, value);
-
-            if (strcmp(value, "Start") > 0 && strcmp(variable, "Sync") == 0)
+        case HCI_SUBEVENT_LE_DATA_LENGTH_CHANGE:
+            link_status.max_tx_octets = hci_subevent_le_data_length_change_get_max_tx_octets(packet);
+            link_status.max_rx_octets = hci_subevent_le_data_length_change_get_max_rx_octets(packet);
+            DEBUG_printf("Data Length Change TX: %d RX: %d\n", link_status.max_tx_octets, link_status.max_rx_octets);
+            break;
+
+        case HCI_SUBEVENT_LE_PHY_UPDATE_COMPLETE:
+            if (hci_subevent_le_phy_update_complete_get_status(packet) == ERROR_CODE_SUCCESS)
             {
-                // Process sync messages for the variable in value field
-                doSync();
-                is_sync_completed = true;
+                link_status.tx_phy = hci_subevent_le_phy_update_complete_get_tx_phy(packet);
+                link_status.rx_phy = hci_subevent_le_phy_update_complete_get_rx_phy(packet);
             }
-            else if (strcmp(variable, "$Time$") == 0)
-            {
-                struct tm d;
-                time_t epoch = atoll(value);
-                memcpy(&d, gmtime(&epoch), sizeof(struct tm));
-                aon_timer_start_calendar(&d);
+            DEBUG_printf("PHY Update Complete TX: %d RX: %d\n", link_status.tx_phy, link_status.rx_phy);
+            break;
 
-                struct tm d1;
-                aon_timer_get_time_calendar(&d1);
-#ifdef DEBUG
-                printf("%s", asctime(&d1));
-#endif
-            }
-            else if (
-                (strcmp(variable, "$AlarmId$") == 0 || strcmp(variable, "$AlarmT$") == 0 || strcmp(variable, "$AlarmR$") == 0) &&
-                strlen(value) > 0)
-            {
-                alarms.process_alarm_request(variable, value);
-            }
-            else if (strcmp(variable, "SD") == 0 && strlen(value) > 0)
-            {
-                if (!send_dir && !send_log_file && !send_file_content)
-                {
-                    file_to_send[0] = '\0';
-                    send_dir = true;
-                }
-            }
-            else if (strcmp(variable, "$SDDL$") == 0 && strlen(value) > 0)
-            {
-                if (!send_file_content && !send_dir && !send_log_file)
-                {
-                    strcpy(file_to_send, value);
-                    send_file_content = true;
-                }
-            }
-            else if (strcmp(variable, "$SDLogData$") == 0 && strlen(value) > 0)
-            {
-                if (!send_log_file && !send_dir && !send_file_content)
-                {
-                    strcpy(file_to_send, value);
-                    send_log_file = true;
-                }
-            }
-            else if (strcmp(variable, "$SDLogPurge$") == 0 && strlen(value) > 0)
-            {
-                if (!send_log_file && !send_dir && !send_file_content)
-                {
-                    sd_manager->sd_purge_data_keeping_labels(value);
-                    // This force sending the empty file to clear the Widget
-                    strcpy(file_to_send, value);
-                    send_log_file = true;
-                }
-            }
-            else
+        case HCI_SUBEVENT_LE_CONNECTION_COMPLETE:
+            link_status.conn_interval = hci_subevent_le_connection_complete_get_conn_interval(packet);
+            link_status.conn_latency = hci_subevent_le_connection_complete_get_conn_latency(packet);
+            link_status.supervision_timeout = hci_subevent_le_connection_complete_get_supervision_timeout(packet);
+            break;
+
+        case HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE:
+            if (hci_subevent_le_connection_update_complete_get_status(packet) == ERROR_CODE_SUCCESS)
             {
-                this->processIncomingMessages(variable, value);
+                link_status.conn_interval = hci_subevent_le_connection_update_complete_get_conn_interval(packet);
+                link_status.conn_latency = hci_subevent_le_connection_update_complete_get_conn_latency(packet);
+                link_status.supervision_timeout = hci_subevent_le_connection_update_complete_get_supervision_timeout(packet);
             }
-        }
-
-        pHash = strtok(NULL, "#");
-    }
+            DEBUG_printf("Connection Update Complete interval: %d latency: %d\n", link_status.conn_interval, link_status.conn_latency);
+            break;
 
-    DEBUG_printf("processBuffer completed \n");
-}
+        default:
+            break;
+        }
+        break;
 
-bool AMController::alarm_timer_callback(__unused struct repeating_timer *t)
-{
-    AMController *p = (AMController *)t->user_data;
+    case L2CAP_EVENT_CONNECTION_PARAMETER_UPDATE_RESPONSE:
+        DEBUG_printf("Connection Parameter Update %s\n", l2cap_event_connection_parameter_update_response_get_result(packet) == 0 ? "accepted" : "rejected");
+        break;
 
-    p->alarms.check_fire_alarms(p->processAlarms);
+    default:
+        break;
+    }
 
-    return true;
+    run_link_upgrade();
 }
 
-void AMController::write_message(const char *variable, int value)
+/**
+ * Sends the pending link upgrade requests, one HCI command at a time.
+ * The central decides: the outcome is recorded when the LE Meta events arrive.
+ */
+void AMController::run_link_upgrade()
 {
-    if (strlen(variable) > VARIABLELEN)
+    if (link_upgrade_pending == 0 || !is_device_connected || !hci_can_send_command_packet_now())
     {
-        DEBUG_printf("Message Discarded\n");
         return;
     }
 
-    // Pointer to our service object
-    custom_service_t *instance = &service_object;
-
-    // Update field value
-    sprintf(instance->characteristic_d_value, "%s=%d#", variable, value);
-
-    // Are notifications enabled? If so, register a callback
-    if (instance->characteristic_d_client_configuration)
+    if (link_upgrade_pending & LINK_UPGRADE_DATA_LENGTH)
     {
-        instance->callback_d.callback = &characteristic_d_callback;
-        instance->callback_d.context = (void *)instance;
-        att_server_register_can_send_now_callback(&instance->callback_d, instance->con_handle);
+        link_upgrade_pending &= ~LINK_UPGRADE_DATA_LENGTH;
+        DEBUG_printf("Requesting Data Length Extension\n");
+        hci_send_cmd(&hci_le_set_data_length, service_object.con_handle, LE_MAX_TX_OCTETS, LE_MAX_TX_TIME);
+        return;
     }
-}
 
-void AMController::write_message(const char *variable, long value)
-{
-    if (strlen(variable) > VARIABLELEN)
+    if (link_upgrade_pending & LINK_UPGRADE_PHY)
     {
-        DEBUG_printf("Message Discarded\n");
-        return;
+        link_upgrade_pending &= ~LINK_UPGRADE_PHY;
+        DEBUG_printf("Requesting LE 2M PHY\n");
+        gap_le_set_phy(service_object.con_handle, 0, LE_PHY_2M_MASK, LE_PHY_2M_MASK, 0);
     }
+}
 
-    // Pointer to our service object
-    custom_service_t *instance = &service_object;
-
-    // Update field value
-    sprintf(instance->characteristic_d_value, "%s=%ld#", variable, value);
+/**
+ * When enabled, Data Length Extension and LE 2M PHY are requested as soon as a device connects.
+ * Call it before init().
+ */
+void AMController::set_link_upgrade(bool enabled)
+{
+    link_upgrade = enabled;
+}
 
-    // Are notifications enabled? If so, register a callback
-    if (instance->characteristic_d_client_configuration)
-    {
-        instance->callback_d.callback = &characteristic_d_callback;
-        instance->callback_d.context = (void *)instance;
-        att_server_register_can_send_now_callback(&instance->callback_d, instance->con_handle);
-    }
+void AMController::get_link_status(link_status_t *status)
+{
+    *status = link_status;
 }
 
-void AMController::write_message(const char *variable, unsigned long value)
+/**
+ * Asks the central to switch to the connection parameters of the profile.
+ * The central may refuse: the parameters in use are reported by get_link_status().
+ */
+void AMController::request_connection_profile(connection_profile_t profile)
 {
-    if (strlen(variable) > VARIABLELEN)
+    if (!is_device_connected || profile == connection_profile)
     {
-        DEBUG_printf("Message Discarded\n");
         return;
     }
 
-    // Pointer to our service object
-    custom_service_t *instance = &service_object;
-
-    // Update field value
-    sprintf(instance->characteristic_d_value, "%s=%lu#", variable, value);
-
-    // Are notifications enabled? If so, register a callback
-    if (instance->characteristic_d_client_configuration)
-    {
-        instance->callback_d.callback = &characteristic_d_callback;
-        instance->callback_d.context = (void *)instance;
-        att_server_register_can_send_now_callback(&instance->callback_d, instance->con_handle);
-    }
-}
+    connection_profile = profile;
 
-void AMController::write_message(const char *variable, float value)
-{
-    if (strlen(variable) > VARIABLELEN)
+    if (profile == CONNECTION_PROFILE_DEFAULT)
     {
-        DEBUG_printf("Message Discarded\n");
         return;
     }
 
-    // Pointer to our service object
-    custom_service_t *instance = &service_object;
+    const connection_parameters_t *parameters = &connection_parameters[profile];
 
-    // Update field value
-    sprintf(instance->characteristic_d_value, "%s=%.5g#", variable, value);
+    DEBUG_printf("Requesting connection profile %d\n", profile);
 
-    // Are notifications enabled? If so, register a callback
-    if (instance->characteristic_d_client_configuration)
-    {
-        instance->callback_d.callback = &characteristic_d_callback;
-        instance->callback_d.context = (void *)instance;
-        att_server_register_can_send_now_callback(&instance->callback_d, instance->con_handle);
-    }
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+    gap_request_connection_parameter_update(service_object.con_handle, parameters->interval_min, parameters->interval_max, parameters->latency, parameters->supervision_timeout);
+    async_context_release_lock(cyw43_arch_async_context());
 }
 
-void AMController::write_message(const char *variable, const char *value)
+/**
+ * When enabled, the low latency profile is requested while syncing and transferring files
+ * and idle_profile the rest of the time
+ */
+void AMController::set_auto_connection_profile(bool enabled, connection_profile_t idle_profile)
 {
-    if (strlen(variable) > VARIABLELEN)
+    auto_connection_profile = enabled;
+    idle_connection_profile = idle_profile;
+}
+
+connection_profile_t AMController::get_connection_profile()
+{
+    return connection_profile;
+}
+
+void AMController::update_connection_profile()
+{
+    if (!auto_connection_profile || !is_device_connected)
     {
-        DEBUG_printf("Message Discarded\n");
         return;
     }
 
-    // Pointer to our service object
-    custom_service_t *instance = &service_object;
-
-    // Update field value
-    sprintf(instance->characteristic_d_value, "%s=%s#", variable, value);
-
-    // Are notifications enabled? If so, register a callback
-    if (instance->characteristic_d_client_configuration)
+    if (!is_sync_completed || send_dir || send_log_file || send_file_content)
     {
-        instance->callback_d.callback = &characteristic_d_callback;
-        instance->callback_d.context = (void *)instance;
-        att_server_register_can_send_now_callback(&instance->callback_d, instance->con_handle);
+        request_connection_profile(CONNECTION_PROFILE_LOW_LATENCY);
     }
-}
-
-void AMController::write_message_immediate(const char *variable, const char *value)
-{
-    if (strlen(variable) > VARIABLELEN)
+    else
     {
-        DEBUG_printf("Message Discarded\n");
-        return;
+        request_connection_profile(idle_connection_profile);
     }
+}
 
-    // Pointer to our service object
-    custom_service_t *instance = &service_object;
+// Received messages are only queued in the BTstack context: the handlers, and the SD card
+// accesses of the built-in verbs, run in the main loop and cannot stall the stack.
+// Each message is parsed straight into its slot of the queue, also when split across writes.
 
-    // Update field value
-    sprintf(instance->characteristic_d_value, "%s=%s#", variable, value);
+incoming_message_t *AMController::static_acquire_incoming_message(void *context)
+{
+    AMController *controller = (AMController *)context;
 
-    // Are notifications enabled? If so, register a callback
-    if (instance->characteristic_d_client_configuration)
+    incoming_message_t *message = controller->incoming_queue.back();
+    if (message == NULL)
     {
-        instance->callback_d.callback = &characteristic_d_callback;
-        instance->callback_d.context = (void *)instance;
-        att_server_register_can_send_now_callback(&instance->callback_d, instance->con_handle);
+        controller->incoming_stats.dropped_full++;
+        DEBUG_printf("Incoming queue full, message dropped\n");
     }
-}
 
-int AMController::can_send_message()
-{
-    custom_service_t *instance = &service_object;
-    return att_server_can_send_packet_now(instance->con_handle);
+    return message;
 }
 
-void AMController::notifiy_message(const char *variable, const char *value)
+void AMController::static_queue_incoming_message(void *context, __unused incoming_message_t *message)
 {
-    // Pointer to our service object
-    custom_service_t *instance = &service_object;
+    AMController *controller = (AMController *)context;
+
+    controller->incoming_queue.push();
+    controller->incoming_stats.received++;
 
-    sprintf(instance->characteristic_d_value, "%s=%s#", variable, value);
-    att_server_notify(instance->con_handle, instance->characteristic_d_handle, reinterpret_cast<uint8_t *>(instance->characteristic_d_value), strlen(instance->characteristic_d_value));
+    controller->wake_up();
 }
 
-void AMController::notify_buffer(const char *value, uint size)
+/**
+ * Ends the wait of the main loop. Can be called from interrupt handlers and from the BTstack context.
+ * Does nothing before init(): the main loop has not started yet.
+ */
+void AMController::wake_up()
 {
-    // Pointer to our service object
-    custom_service_t *instance = &service_object;
+    if (!wake_up_ready)
+    {
+        return;
+    }
 
-    sprintf(instance->characteristic_d_value, "%s", value);
-    att_server_notify(instance->con_handle, instance->characteristic_d_handle, reinterpret_cast<uint8_t *>(instance->characteristic_d_value), size);
+    sem_release(&wake_up_sem);
+#if PICO_CYW43_ARCH_POLL
+    async_context_set_work_pending(cyw43_arch_async_context(), &wake_up_worker);
+#endif
 }
 
-void AMController::write_message_buffer(const char *value, uint size)
+void AMController::process_incoming_messages()
 {
-    // Pointer to our service object
-    custom_service_t *instance = &service_object;
+    incoming_message_t *message;
 
-    // Update field value
-    sprintf(instance->characteristic_d_value, "%s", value);
-
-    // Are notifications enabled? If so, register a callback
-    if (instance->characteristic_d_client_configuration)
+    while ((message = incoming_queue.front()) != NULL)
     {
-        instance->callback_d.callback = &characteristic_d_callback;
-        instance->callback_d.context = (void *)instance;
-        att_server_register_can_send_now_callback(&instance->callback_d, instance->con_handle);
+        process_message(message->variable, message->value);
+        incoming_queue.pop();
     }
 }
 
-void AMController::write_message(const char *variable, float x, float y, float z)
+/**
+ * Processes a <variable>=<value> message received from the device
+ */
+void AMController::process_message(char *variable, char *value)
+{
+    DEBUG_printf("\tvariable %s - value: %s\n", variable, value);
+
+    // Built-in verbs are routed on the hash of the variable: the cost does not depend on their number.
+    // Duplicate case labels would not compile, so the hash is perfect on the verbs and a single strcmp confirms the match.
+    uint32_t hash = verb_hash(variable);
+
+    switch (hash)
+    {
+    case verb_hash("Sync"):
+        if (strcmp(variable, "Sync") == 0 && strcmp(value, "Start") > 0)
+        {
+            // Process sync messages for the variable in value field
+            // Widgets are initialized with the current values, even if unchanged
+            reset_deadbands();
+            doSync();
+            is_sync_completed = true;
+            return;
+        }
+        break;
+
+    case verb_hash("$Time$"):
+        if (strcmp(variable, "$Time$") == 0)
+        {
+            struct tm d;
+            time_t epoch = atoll(value);
+            memcpy(&d, gmtime(&epoch), sizeof(struct tm));
+            aon_timer_start_calendar(&d);
+            time_set = true;
+
+            struct tm d1;
+            aon_timer_get_time_calendar(&d1);
+#ifdef DEBUG
+            printf("%s", asctime(&d1));
+#endif
+            schedule_alarms_check();
+            return;
+        }
+        break;
+
+    case verb_hash("$AlarmId$"):
+    case verb_hash("$AlarmT$"):
+    case verb_hash("$AlarmR$"):
+        if ((strcmp(variable, "$AlarmId$") == 0 || strcmp(variable, "$AlarmT$") == 0 || strcmp(variable, "$AlarmR$") == 0) &&
+            strlen(value) > 0)
+        {
+            claim_sd_card();
+            alarms.process_alarm_request(variable, value);
+            schedule_alarms_check();
+            return;
+        }
+        break;
+
+    case verb_hash("SD"):
+        if (strcmp(variable, "SD") == 0 && strlen(value) > 0)
+        {
+            if (!send_dir && !send_log_file && !send_file_content)
+            {
+                file_to_send[0] = '\0';
+                send_dir = true;
+            }
+            return;
+        }
+        break;
+
+    case verb_hash("$SDDL$"):
+        if (strcmp(variable, "$SDDL$") == 0 && strlen(value) > 0)
+        {
+            if (!send_file_content && !send_dir && !send_log_file)
+            {
+                snprintf(file_to_send, sizeof(file_to_send), "%s", value);
+                send_file_content = true;
+            }
+            return;
+        }
+        break;
+
+    case verb_hash("$SDLogData$"):
+        if (strcmp(variable, "$SDLogData$") == 0 && strlen(value) > 0)
+        {
+            if (!send_log_file && !send_dir && !send_file_content)
+            {
+                snprintf(file_to_send, sizeof(file_to_send), "%s", value);
+                send_log_file = true;
+            }
+            return;
+        }
+        break;
+
+    case verb_hash("$SDLogPurge$"):
+        if (strcmp(variable, "$SDLogPurge$") == 0 && strlen(value) > 0)
+        {
+            if (!send_log_file && !send_dir && !send_file_content)
+            {
+                // Through core 1 when it runs, so that the size kept for log_size() follows
+                if (!sd_worker.is_running() || !sd_worker.purge(value, true))
+                {
+                    claim_sd_card();
+                    sd_manager->sd_purge_data_keeping_labels(value);
+                }
+                // This force sending the empty file to clear the Widget
+                snprintf(file_to_send, sizeof(file_to_send), "%s", value);
+                send_log_file = true;
+            }
+            return;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    if (dispatch_to_handler(hash, variable, value))
+    {
+        return;
+    }
+
+    this->processIncomingMessages(variable, value);
+}
+
+/**
+ * Registered handlers receive the value of their variable already parsed,
+ * in place of processIncomingMessages. Call them before init().
+ * Return false if variable is too long or there are already MAX_MESSAGE_HANDLERS handlers.
+ */
+bool AMController::register_handler(const char *variable, void (*handler)(bool value))
+{
+    return add_handler(variable, HANDLER_BOOL, reinterpret_cast<void (*)()>(handler));
+}
+
+bool AMController::register_handler(const char *variable, void (*handler)(long value))
+{
+    return add_handler(variable, HANDLER_LONG, reinterpret_cast<void (*)()>(handler));
+}
+
+bool AMController::register_handler(const char *variable, void (*handler)(float value))
+{
+    return add_handler(variable, HANDLER_FLOAT, reinterpret_cast<void (*)()>(handler));
+}
+
+bool AMController::register_handler(const char *variable, void (*handler)(const char *value))
+{
+    return add_handler(variable, HANDLER_STRING, reinterpret_cast<void (*)()>(handler));
+}
+
+bool AMController::register_handler(const char *variable, void (*handler)(float x, float y, float z))
+{
+    return add_handler(variable, HANDLER_XYZ, reinterpret_cast<void (*)()>(handler));
+}
+
+bool AMController::add_handler(const char *variable, uint8_t type, void (*handler)())
+{
+    if (strlen(variable) > VARIABLELEN)
+    {
+        DEBUG_printf("Handler of %s not registered\n", variable);
+        return false;
+    }
+
+    uint32_t hash = verb_hash(variable);
+
+    // A variable registered again gets the new handler
+    for (int i = 0; i < message_handlers_count; i++)
+    {
+        if (message_handlers[i].hash == hash && strcmp(message_handlers[i].variable, variable) == 0)
+        {
+            message_handlers[i].type = type;
+            message_handlers[i].handler = handler;
+            return true;
+        }
+    }
+
+    if (message_handlers_count == MAX_MESSAGE_HANDLERS)
+    {
+        DEBUG_printf("Handler of %s not registered\n", variable);
+        return false;
+    }
+
+    // Keeps the table sorted by hash
+    int idx = message_handlers_count;
+    while (idx > 0 && message_handlers[idx - 1].hash > hash)
+    {
+        message_handlers[idx] = message_handlers[idx - 1];
+        idx--;
+    }
+
+    message_handler_t *entry = &message_handlers[idx];
+    entry->hash = hash;
+    strcpy(entry->variable, variable);
+    entry->type = type;
+    entry->handler = handler;
+
+    message_handlers_count++;
+
+    return true;
+}
+
+/**
+ * Looks for the handler of variable (binary search on the hash) and calls it with the parsed value.
+ * Returns false if no handler is registered for variable.
+ */
+bool AMController::dispatch_to_handler(uint32_t hash, const char *variable, const char *value)
+{
+    int low = 0;
+    int high = message_handlers_count;
+
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (message_handlers[mid].hash < hash)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    // Different variables may share the hash
+    for (int i = low; i < message_handlers_count && message_handlers[i].hash == hash; i++)
+    {
+        message_handler_t *entry = &message_handlers[i];
+        if (strcmp(entry->variable, variable) != 0)
+        {
+            continue;
+        }
+
+        switch (entry->type)
+        {
+        case HANDLER_BOOL:
+            reinterpret_cast<void (*)(bool)>(entry->handler)(strtol(value, NULL, 10) != 0);
+            break;
+
+        case HANDLER_LONG:
+            reinterpret_cast<void (*)(long)>(entry->handler)(strtol(value, NULL, 10));
+            break;
+
+        case HANDLER_FLOAT:
+            reinterpret_cast<void (*)(float)>(entry->handler)(strtof(value, NULL));
+            break;
+
+        case HANDLER_STRING:
+            reinterpret_cast<void (*)(const char *)>(entry->handler)(value);
+            break;
+
+        case HANDLER_XYZ:
+        {
+            // x:y:z
+            char *end;
+            float x = strtof(value, &end);
+            float y = *end == ':' ? strtof(end + 1, &end) : 0;
+            float z = *end == ':' ? strtof(end + 1, &end) : 0;
+            reinterpret_cast<void (*)(float, float, float)>(entry->handler)(x, y, z);
+            break;
+        }
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+int64_t AMController::alarm_timer_callback(__unused alarm_id_t id, void *user_data)
+{
+    AMController *p = (AMController *)user_data;
+
+    // Alarms fire SD writes and user code: they are checked by the main loop
+    p->alarms_check_alarm = 0;
+    p->alarms_check_due = true;
+    p->wake_up();
+
+    return 0;
+}
+
+/**
+ * Arms the alarms timer at the time of the next alarm, instead of polling the alarms.
+ * The timer is capped to ALARMS_MAX_CHECKS_PERIOD since the time can be changed by the device.
+ * Called whenever the alarms or the time change. Nothing is armed until $Time$ is received:
+ * on the default clock every alarm would look overdue.
+ */
+void AMController::schedule_alarms_check()
+{
+    if (alarms_check_alarm > 0)
+    {
+        cancel_alarm(alarms_check_alarm);
+        alarms_check_alarm = 0;
+    }
+
+    time_t next;
+    if (!alarms_enabled || !time_set || !alarms.next_alarm_time(&next))
+    {
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (next <= now)
+    {
+        alarms_check_due = true;
+        wake_up();
+        return;
+    }
+
+    uint32_t delay_ms = ALARMS_MAX_CHECKS_PERIOD;
+    if (next - now < ALARMS_MAX_CHECKS_PERIOD / 1000)
+    {
+        delay_ms = (uint32_t)(next - now) * 1000;
+    }
+
+    alarms_check_alarm = add_alarm_in_ms(delay_ms, &AMController::alarm_timer_callback, this, true);
+}
+
+void AMController::write_message(const char *variable, int value)
+{
+    queue_long(variable, strlen(variable), false, value);
+}
+
+void AMController::write_message(const char *variable, long value)
+{
+    queue_long(variable, strlen(variable), false, value);
+}
+
+void AMController::write_message(const char *variable, unsigned long value)
+{
+    queue_unsigned_long(variable, strlen(variable), false, value);
+}
+
+void AMController::write_message(const char *variable, float value)
+{
+    queue_float(variable, strlen(variable), false, value);
+}
+
+void AMController::write_message(const char *variable, const char *value)
+{
+    queue_string(variable, strlen(variable), false, value, coalesce_messages);
+}
+
+void AMController::write_message_immediate(const char *variable, const char *value)
 {
     if (strlen(variable) > VARIABLELEN)
     {
-        DEBUG_printf("Message Discarded\n");
+        DEBUG_printf("Message Discarded\n");
+        return;
+    }
+
+    // The queue and BTstack are also used from the BTstack context
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+
+    // Nothing can overtake the messages already queued
+    if (!can_send_message())
+    {
+        queue_string(variable, strlen(variable), false, value, false);
+    }
+    else
+    {
+        notify_message_now(variable, value);
+    }
+
+    async_context_release_lock(cyw43_arch_async_context());
+}
+
+int AMController::can_send_message()
+{
+    custom_service_t *instance = &service_object;
+
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+
+    // Queued messages are sent first
+    int can_send = outgoing_count == 0 && att_server_can_send_packet_now(instance->con_handle);
+
+    async_context_release_lock(cyw43_arch_async_context());
+
+    return can_send;
+}
+
+uint16_t AMController::get_mtu()
+{
+    return att_mtu;
+}
+
+/**
+ * Max number of bytes that can be sent in a single notification on the current connection
+ */
+uint16_t AMController::max_payload_size()
+{
+    return MIN(att_mtu - 3, ATT_MAX_PAYLOAD_SIZE);
+}
+
+void AMController::notifiy_message(const char *variable, const char *value)
+{
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+    notify_message_now(variable, value);
+    async_context_release_lock(cyw43_arch_async_context());
+}
+
+/**
+ * Notifies <variable>=<value># in a single notification. A message longer than the payload allowed
+ * by the MTU is discarded and counted in dropped_too_long: BTstack would cut off its #.
+ * Called with the async_context lock held.
+ */
+bool AMController::notify_message_now(const char *variable, const char *value)
+{
+    // Pointer to our service object
+    custom_service_t *instance = &service_object;
+
+    uint16_t max_size = max_payload_size();
+
+    int len = snprintf(instance->characteristic_d_value, max_size + 1, "%s=%s#", variable, value);
+    if (len < 0 || len > max_size)
+    {
+        instance->characteristic_d_value[0] = '\0';
+        outgoing_stats.dropped_too_long++;
+        DEBUG_printf("Message Discarded - Longer than the MTU\n");
+        return false;
+    }
+
+    return att_server_notify(instance->con_handle, instance->characteristic_d_handle, reinterpret_cast<uint8_t *>(instance->characteristic_d_value), len) == ERROR_CODE_SUCCESS;
+}
+
+/**
+ * Notifies size bytes straight from value: no copy and no formatting, so binary data (NUL bytes included) is sent as is.
+ * BTstack copies the data into its own buffer, so value can be reused as soon as the function returns.
+ * Returns false if the notification could not be sent.
+ */
+bool AMController::notify_buffer(const char *value, uint size)
+{
+    // Pointer to our service object
+    custom_service_t *instance = &service_object;
+
+    // Called from the main loop: BTstack runs in the async context
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+    bool sent = att_server_notify(instance->con_handle, instance->characteristic_d_handle, reinterpret_cast<const uint8_t *>(value), size) == ERROR_CODE_SUCCESS;
+    async_context_release_lock(cyw43_arch_async_context());
+
+    return sent;
+}
+
+void AMController::write_message_buffer(const char *value, uint size)
+{
+    char *p = begin_message(NULL, 0, false, false, size);
+    if (p != NULL)
+    {
+        memcpy(p, value, size);
+        commit_message(p + size);
+    }
+}
+
+void AMController::write_message(const char *variable, float x, float y, float z)
+{
+    queue_xyz(variable, strlen(variable), false, x, y, z);
+}
+
+/**
+ * Reserves the outgoing frame for <variable>= and returns where the value (at most value_size bytes,
+ * # included) has to be written, or NULL if the message cannot be queued.
+ * When coalesce is true and a value of the same variable is still pending, its frame is reused.
+ * Reserved variables ($D$, $DLN$, ...) are streams and are never coalesced.
+ * When prefixed is true, variable is the <name>= prefix of an AMVariable, variable_len being the length of the name.
+ * A NULL variable reserves a frame for raw text.
+ * The queue stays locked until commit_message() is called with the end of the value.
+ */
+char *AMController::begin_message(const char *variable, size_t variable_len, bool prefixed, bool coalesce, size_t value_size)
+{
+    if (variable_len > VARIABLELEN)
+    {
+        DEBUG_printf("Message Discarded\n");
+        return NULL;
+    }
+
+    // Nobody is listening
+    if (!service_object.characteristic_d_client_configuration)
+    {
+        return NULL;
+    }
+
+    size_t prefix_len = variable != NULL ? variable_len + 1 : 0;
+
+    lock_outgoing_queue();
+
+    if (prefix_len + value_size > OUTGOING_FRAME_SIZE)
+    {
+        outgoing_stats.dropped_too_long++;
+        unlock_outgoing_queue();
+        DEBUG_printf("Message Discarded - Too long\n");
+        return NULL;
+    }
+
+    if (variable_len == 0 || variable[0] == '$')
+    {
+        coalesce = false;
+    }
+
+    outgoing_frame_t *frame = NULL;
+
+    if (coalesce)
+    {
+        // Look for the slot of the variable among the pending messages
+        for (uint16_t i = 0; i < outgoing_count; i++)
+        {
+            outgoing_frame_t *pending = &outgoing_frames[(outgoing_head + i) % OUTGOING_QUEUE_SIZE];
+            if (pending->variable_len == variable_len && memcmp(pending->text, variable, variable_len) == 0)
+            {
+                frame = pending;
+                break;
+            }
+        }
+    }
+
+    if (frame != NULL)
+    {
+        outgoing_stats.coalesced++;
+    }
+    else
+    {
+        if (outgoing_count == OUTGOING_QUEUE_SIZE)
+        {
+            outgoing_stats.dropped_full++;
+            unlock_outgoing_queue();
+            DEBUG_printf("Message Discarded - Queue full\n");
+            return NULL;
+        }
+
+        frame = &outgoing_frames[(outgoing_head + outgoing_count) % OUTGOING_QUEUE_SIZE];
+        outgoing_count++;
+        outgoing_stats.queued++;
+        if (outgoing_count > outgoing_stats.high_water_mark)
+        {
+            outgoing_stats.high_water_mark = outgoing_count;
+        }
+
+        if (prefix_len > 0)
+        {
+            if (prefixed)
+            {
+                memcpy(frame->text, variable, prefix_len); // Prefix of an AMVariable
+            }
+            else
+            {
+                memcpy(frame->text, variable, variable_len);
+                frame->text[variable_len] = '=';
+            }
+        }
+    }
+
+    frame->variable_len = coalesce ? variable_len : 0;
+    writing_frame = frame;
+
+    return frame->text + prefix_len;
+}
+
+/**
+ * Completes the message started by begin_message() and asks BTstack for an ATT_EVENT_CAN_SEND_NOW
+ */
+void AMController::commit_message(char *end)
+{
+    writing_frame->len = end - writing_frame->text;
+    writing_frame = NULL;
+
+    att_server_request_can_send_now_event(service_object.con_handle);
+
+    unlock_outgoing_queue();
+}
+
+// The write_message overloads, with the variable name and its length
+
+void AMController::queue_long(const char *variable, size_t variable_len, bool prefixed, long value)
+{
+    if (is_within_deadband(variable, variable_len, value))
+    {
+        return;
+    }
+
+    char *p = begin_message(variable, variable_len, prefixed, coalesce_messages, FORMAT_MAX_SIZE);
+    if (p != NULL)
+    {
+        p = format_long(p, value);
+        *p++ = '#';
+        commit_message(p);
+        record_deadband(variable, variable_len, value);
+    }
+}
+
+void AMController::queue_unsigned_long(const char *variable, size_t variable_len, bool prefixed, unsigned long value)
+{
+    if (is_within_deadband(variable, variable_len, value))
+    {
+        return;
+    }
+
+    char *p = begin_message(variable, variable_len, prefixed, coalesce_messages, FORMAT_MAX_SIZE);
+    if (p != NULL)
+    {
+        p = format_unsigned_long(p, value);
+        *p++ = '#';
+        commit_message(p);
+        record_deadband(variable, variable_len, value);
+    }
+}
+
+void AMController::queue_float(const char *variable, size_t variable_len, bool prefixed, float value)
+{
+    if (is_within_deadband(variable, variable_len, value))
+    {
+        return;
+    }
+
+    char *p = begin_message(variable, variable_len, prefixed, coalesce_messages, FORMAT_MAX_SIZE);
+    if (p != NULL)
+    {
+        p = format_float(p, value);
+        *p++ = '#';
+        commit_message(p);
+        record_deadband(variable, variable_len, value);
+    }
+}
+
+/**
+ * Returns true if value does not need to be sent because within the deadband of the last value sent
+ */
+bool AMController::is_within_deadband(const char *variable, size_t variable_len, float value)
+{
+    if (variable_len == 0 || !service_object.characteristic_d_client_configuration)
+    {
+        return false;
+    }
+
+    deadband_t *deadband = find_deadband(variable, variable_len);
+    if (deadband == NULL)
+    {
+        return false;
+    }
+
+    uint32_t now_ms = to_ms_since_boot(get_absolute_time());
+
+    if (deadband->has_last)
+    {
+        float change = fabsf(value - deadband->last_value);
+        float threshold = MAX(deadband->absolute, deadband->relative * fabsf(deadband->last_value));
+        bool refresh_due = deadband->refresh_ms != 0 && now_ms - deadband->last_time_ms >= deadband->refresh_ms;
+
+        if (change <= threshold && !refresh_due)
+        {
+            lock_outgoing_queue();
+            outgoing_stats.suppressed++;
+            unlock_outgoing_queue();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Records value as the last value sent, once its message is queued: a dropped message does not move the deadband
+ */
+void AMController::record_deadband(const char *variable, size_t variable_len, float value)
+{
+    deadband_t *deadband = find_deadband(variable, variable_len);
+    if (deadband == NULL)
+    {
         return;
     }
 
+    deadband->has_last = true;
+    deadband->last_value = value;
+    deadband->last_time_ms = to_ms_since_boot(get_absolute_time());
+}
+
+void AMController::queue_string(const char *variable, size_t variable_len, bool prefixed, const char *value, bool coalesce)
+{
+    size_t len = strlen(value);
+
+    char *p = begin_message(variable, variable_len, prefixed, coalesce, len + 1);
+    if (p != NULL)
+    {
+        memcpy(p, value, len);
+        p[len] = '#';
+        commit_message(p + len + 1);
+    }
+}
+
+void AMController::queue_xyz(const char *variable, size_t variable_len, bool prefixed, float x, float y, float z)
+{
+    char value[3 * FORMAT_MAX_SIZE];
+    char *p = format_float_fixed(value, x);
+    *p++ = ':';
+    p = format_float_fixed(p, y);
+    *p++ = ':';
+    p = format_float_fixed(p, z);
+
+    queue_string(variable, variable_len, prefixed, value, coalesce_messages);
+}
+
+/**
+ * Notifies the queued messages, packing as many of them as the ATT MTU allows in a single notification.
+ * Messages are # terminated, so the receiver splits them as usual.
+ * Called from the BTstack context on ATT_EVENT_CAN_SEND_NOW.
+ */
+void AMController::send_queued_messages()
+{
     // Pointer to our service object
     custom_service_t *instance = &service_object;
 
-    // Update field value
-    sprintf(instance->characteristic_d_value, "%s=%.2f:%.2f:%.2f#", variable, x, y, z);
+    if (outgoing_count == 0 || !instance->characteristic_d_client_configuration)
+    {
+        return;
+    }
+
+    uint16_t max_size = max_payload_size();
+
+    // A message longer than the MTU would be cut off by BTstack, # included, and joined by the
+    // receiver with the next one: it is discarded
+    while (outgoing_count > 0 && outgoing_frames[outgoing_head].len > max_size)
+    {
+        outgoing_head = (outgoing_head + 1) % OUTGOING_QUEUE_SIZE;
+        outgoing_count--;
+        outgoing_stats.dropped_too_long++;
+        DEBUG_printf("Message Discarded - Longer than the MTU\n");
+    }
+
+    if (outgoing_count == 0)
+    {
+        return;
+    }
+
+    outgoing_frame_t *frame = &outgoing_frames[outgoing_head];
+    const uint8_t *data = reinterpret_cast<uint8_t *>(frame->text);
+    uint16_t size = frame->len;
+    uint16_t frames = 1;
+
+    while (frames < outgoing_count)
+    {
+        outgoing_frame_t *next = &outgoing_frames[(outgoing_head + frames) % OUTGOING_QUEUE_SIZE];
+        if (size + next->len > max_size)
+        {
+            break;
+        }
+        if (frames == 1)
+        {
+            memcpy(notification_buffer, frame->text, frame->len);
+            data = notification_buffer;
+        }
+        memcpy(notification_buffer + size, next->text, next->len);
+        size += next->len;
+        frames++;
+    }
+
+    if (att_server_notify(instance->con_handle, instance->characteristic_d_handle, data, size) == ERROR_CODE_SUCCESS)
+    {
+        outgoing_head = (outgoing_head + frames) % OUTGOING_QUEUE_SIZE;
+        outgoing_count -= frames;
+        outgoing_stats.sent += frames;
+        outgoing_stats.notifications++;
+    }
+
+    if (outgoing_count > 0)
+    {
+        att_server_request_can_send_now_event(instance->con_handle);
+    }
+}
+
+void AMController::clear_outgoing_queue()
+{
+    outgoing_head = 0;
+    outgoing_count = 0;
+}
+
+void AMController::set_coalescing(bool enabled)
+{
+    coalesce_messages = enabled;
+}
+
+/**
+ * Numeric values of variable are not sent when they differ from the last value sent
+ * by no more than absolute or by no more than relative * |last value|.
+ * If refresh_ms is not 0, the value is sent anyway once refresh_ms have elapsed.
+ * Returns false if there are already MAX_DEADBANDS variables with a deadband.
+ */
+bool AMController::set_deadband(const char *variable, float absolute, float relative, uint32_t refresh_ms)
+{
+    size_t variable_len = strlen(variable);
+    if (variable_len == 0 || variable_len > VARIABLELEN)
+    {
+        return false;
+    }
+
+    deadband_t *deadband = find_deadband(variable, variable_len);
+    if (deadband == NULL)
+    {
+        deadband = find_deadband(NULL, 0);
+        if (deadband == NULL)
+        {
+            DEBUG_printf("No room for the deadband of %s\n", variable);
+            return false;
+        }
+        strcpy(deadband->variable, variable);
+        deadband->variable_len = variable_len;
+        deadband->has_last = false;
+    }
+
+    deadband->absolute = absolute;
+    deadband->relative = relative;
+    deadband->refresh_ms = refresh_ms;
+
+    return true;
+}
+
+void AMController::clear_deadband(const char *variable)
+{
+    deadband_t *deadband = find_deadband(variable, strlen(variable));
+    if (deadband != NULL)
+    {
+        deadband->variable_len = 0;
+    }
+}
+
+/**
+ * Returns the deadband of variable, or a free entry when variable is NULL
+ */
+static deadband_t *find_deadband(const char *variable, size_t variable_len)
+{
+    for (int i = 0; i < MAX_DEADBANDS; i++)
+    {
+        if (deadbands[i].variable_len == variable_len &&
+            (variable_len == 0 || memcmp(deadbands[i].variable, variable, variable_len) == 0))
+        {
+            return &deadbands[i];
+        }
+    }
+    return NULL;
+}
 
-    // Are notifications enabled? If so, register a callback
-    if (instance->characteristic_d_client_configuration)
+static void reset_deadbands()
+{
+    for (int i = 0; i < MAX_DEADBANDS; i++)
     {
-        instance->callback_d.callback = &characteristic_d_callback;
-        instance->callback_d.context = (void *)instance;
-        att_server_register_can_send_now_callback(&instance->callback_d, instance->con_handle);
+        deadbands[i].has_last = false;
     }
 }
 
+uint16_t AMController::outgoing_queue_pending()
+{
+    return outgoing_count;
+}
+
+void AMController::get_outgoing_queue_stats(outgoing_queue_stats_t *stats)
+{
+    lock_outgoing_queue();
+    *stats = outgoing_stats;
+    unlock_outgoing_queue();
+}
+
+void AMController::reset_outgoing_queue_stats()
+{
+    lock_outgoing_queue();
+    memset(&outgoing_stats, 0, sizeof(outgoing_stats));
+    outgoing_stats.high_water_mark = outgoing_count;
+    unlock_outgoing_queue();
+}
+
+/**
+ * Sets how often doWork and processOutgoingMessages are called (default WORK_PERIOD_MS).
+ * The main loop sleeps in between unless something else needs it.
+ */
+void AMController::set_work_period(uint32_t period_ms)
+{
+    work_period_ms = period_ms;
+}
+
+/**
+ * Runs doWork and processOutgoingMessages as soon as possible instead of at the next period,
+ * e.g. from a GPIO interrupt handler.
+ */
+void AMController::request_work()
+{
+    work_requested = true;
+    wake_up();
+}
+
+/**
+ * Tasks are run by the main loop, see TaskScheduler. They can be added and removed before init()
+ * and from the main loop callbacks (tasks included), not from interrupt handlers.
+ * Return the id of the task or -1 if there are already MAX_TASKS tasks.
+ */
+int AMController::add_task(void (*task)(void), uint32_t period_ms, uint8_t priority)
+{
+    return scheduler.add_task(task, period_ms, priority, true);
+}
+
+int AMController::add_one_shot_task(void (*task)(void), uint32_t delay_ms, uint8_t priority)
+{
+    return scheduler.add_task(task, delay_ms, priority, false);
+}
+
+bool AMController::remove_task(int id)
+{
+    return scheduler.remove_task(id);
+}
+
+bool AMController::get_task_stats(int id, task_stats_t *stats)
+{
+    return scheduler.get_task_stats(id, stats);
+}
+
+void AMController::reset_task_stats(int id)
+{
+    scheduler.reset_task_stats(id);
+}
+
+void AMController::get_incoming_queue_stats(incoming_queue_stats_t *stats)
+{
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+    *stats = incoming_stats;
+    stats->dropped_too_long = message_parser.get_overflows();
+    async_context_release_lock(cyw43_arch_async_context());
+}
+
+void AMController::reset_incoming_queue_stats()
+{
+    async_context_acquire_lock_blocking(cyw43_arch_async_context());
+    memset(&incoming_stats, 0, sizeof(incoming_stats));
+    message_parser.clear_overflows();
+    async_context_release_lock(cyw43_arch_async_context());
+}
+
 unsigned long AMController::now()
 {
     time_t now = time(NULL);
@@ -759,71 +1868,203 @@ void AMController::logLn(const char *msg)
 
 void AMController::log_labels(const char *variable, const char *label1)
 {
-    sd_manager->sd_log_labels(variable, label1, NULL, NULL, NULL, NULL);
+    store_labels(variable, label1, NULL, NULL, NULL, NULL);
 }
 
 void AMController::log_labels(const char *variable, const char *label1, const char *label2)
 {
-    sd_manager->sd_log_labels(variable, label1, label2, NULL, NULL, NULL);
+    store_labels(variable, label1, label2, NULL, NULL, NULL);
 }
 
 void AMController::log_labels(const char *variable, const char *label1, const char *label2, const char *label3)
 {
-    sd_manager->sd_log_labels(variable, label1, label2, label3, NULL, NULL);
+    store_labels(variable, label1, label2, label3, NULL, NULL);
 }
 
 void AMController::log_labels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4)
 {
-    sd_manager->sd_log_labels(variable, label1, label2, label3, label4, NULL);
+    store_labels(variable, label1, label2, label3, label4, NULL);
 }
 
 void AMController::log_labels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4, const char *label5)
 {
-    sd_manager->sd_log_labels(variable, label1, label2, label3, label4, label5);
+    store_labels(variable, label1, label2, label3, label4, label5);
 }
 
 void AMController::log_value(const char *variable, unsigned long time, float v1)
 {
-    sd_manager->log_value(variable, time, v1);
+    float values[] = {v1};
+    store_values(variable, time, values, 1);
 }
 
 void AMController::log_value(const char *variable, unsigned long time, float v1, float v2)
 {
-    sd_manager->log_value(variable, time, v1, v2);
+    float values[] = {v1, v2};
+    store_values(variable, time, values, 2);
 }
 
 void AMController::log_value(const char *variable, unsigned long time, float v1, float v2, float v3)
 {
-    sd_manager->log_value(variable, time, v1, v2, v3);
+    float values[] = {v1, v2, v3};
+    store_values(variable, time, values, 3);
 }
 
 void AMController::log_value(const char *variable, unsigned long time, float v1, float v2, float v3, float v4)
 {
-    sd_manager->log_value(variable, time, v1, v2, v3, v4);
+    float values[] = {v1, v2, v3, v4};
+    store_values(variable, time, values, 4);
 }
 
 void AMController::log_value(const char *variable, unsigned long time, float v1, float v2, float v3, float v4, float v5)
 {
-    sd_manager->log_value(variable, time, v1, v2, v3, v4, v5);
+    float values[] = {v1, v2, v3, v4, v5};
+    store_values(variable, time, values, 5);
 }
 
+/**
+ * With set_sd_on_core1() the size is the one sent back by core 1 after the last command on the log:
+ * only the first call for a log waits for core 1.
+ */
 unsigned long AMController::log_size(const char *variable)
 {
+    unsigned long size;
+
+    if (sd_worker.is_running())
+    {
+        if (sd_worker.get_log_size(variable, &size))
+        {
+            return size;
+        }
+
+        sd_worker.query_log_size(variable);
+        claim_sd_card();
+        if (sd_worker.get_log_size(variable, &size))
+        {
+            return size;
+        }
+    }
+
     return sd_manager->sd_log_size(variable);
 }
 
 void AMController::log_purge_data(const char *variable)
 {
+    if (sd_worker.is_running())
+    {
+        sd_worker.purge(variable, false);
+        return;
+    }
     sd_manager->sd_purge_data(variable);
 }
 
-void AMController::gpio_temporary_put(uint pin, bool value, uint ms)
+// With set_sd_on_core1() logging only queues a command for core 1
+
+void AMController::store_labels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4, const char *label5)
+{
+    if (sd_worker.is_running())
+    {
+        sd_worker.log_labels(variable, label1, label2, label3, label4, label5);
+        return;
+    }
+    sd_manager->sd_log_labels(variable, label1, label2, label3, label4, label5);
+}
+
+void AMController::store_values(const char *variable, unsigned long time, float *values, uint8_t count)
+{
+    if (sd_worker.is_running())
+    {
+        sd_worker.log_values(variable, time, values, count);
+        return;
+    }
+    sd_manager->log_values(variable, time, &values[0],
+                           count > 1 ? &values[1] : NULL,
+                           count > 2 ? &values[2] : NULL,
+                           count > 3 ? &values[3] : NULL,
+                           count > 4 ? &values[4] : NULL);
+}
+
+/**
+ * Waits until core 1 has executed the SD commands queued: the card can then be accessed directly
+ */
+void AMController::claim_sd_card()
+{
+    if (sd_worker.is_running())
+    {
+        sd_worker.flush();
+    }
+}
+
+/**
+ * Runs the SD card writes of the logs (log_labels, log_value, log_purge_data) on core 1:
+ * logging a value only queues it. Call before init(), core 1 must not be used by the application.
+ */
+void AMController::set_sd_on_core1(bool enabled)
+{
+    sd_on_core1 = enabled;
+}
+
+void AMController::get_sd_worker_stats(sd_worker_stats_t *stats)
+{
+    sd_worker.get_stats(stats);
+}
+
+/**
+ * While no device is connected the main loop sleeps until the next task, alarm or BLE event:
+ * doWork runs only on request_work(). Periodic work must be moved to tasks.
+ */
+void AMController::set_low_power_idle(bool enabled)
+{
+    low_power_idle = enabled;
+    wake_up();
+}
+
+void AMController::get_idle_stats(idle_stats_t *stats)
+{
+    *stats = idle_stats;
+}
+
+void AMController::reset_idle_stats()
+{
+    memset(&idle_stats, 0, sizeof(idle_stats));
+}
+
+/**
+ * Sets the pin to value for ms, then restores its previous level. Returns at once:
+ * the pin is restored by a timer. Returns false if the pulse cannot be started.
+ * With ms 0 the pin is set and restored right away, as sleep_ms(0) did.
+ */
+bool AMController::gpio_temporary_put(uint pin, bool value, uint ms)
+{
+    if (ms == 0)
+    {
+        pulses.stop(pin); // A pulse in progress ends first, its level restored
+
+        bool previous_value = gpio_get(pin);
+        gpio_put(pin, value);
+        gpio_put(pin, previous_value);
+        return true;
+    }
+
+    return pulses.start(pin, value, ms, 0, 1);
+}
+
+/**
+ * Sets the pin to value for on_ms, count times every on_ms + off_ms (until gpio_pulse_stop() if count is 0).
+ * Up to MAX_PULSES pins can pulse at the same time.
+ */
+bool AMController::gpio_pulse_train(uint pin, bool value, uint on_ms, uint off_ms, uint16_t count)
 {
-    bool previousValue = gpio_get(pin);
+    return pulses.start(pin, value, on_ms, off_ms, count);
+}
+
+bool AMController::gpio_pulse_stop(uint pin)
+{
+    return pulses.stop(pin);
+}
 
-    gpio_put(pin, value);
-    sleep_ms(ms);
-    gpio_put(pin, previousValue);
+bool AMController::gpio_pulse_active(uint pin)
+{
+    return pulses.is_active(pin);
 }
 
 float AMController::to_voltage(uint16_t adc_value, float vref)
@@ -832,8 +2073,18 @@ float AMController::to_voltage(uint16_t adc_value, float vref)
    return adc_value * conversion_factor;
 }
 
+/**
+ * Blocking average of samples conversions of the selected input.
+ * While the ADC sampler runs, returns the last block average of the input given to adc_sampler_start() instead:
+ * samples is ignored, the block size sets the window.
+ */
 uint16_t AMController::avg_adc_read(uint8_t samples)
 {
+   if (adc_sampler.is_running())
+   {
+      return adc_sampler.get_average(adc_sampler.get_input());
+   }
+
    uint32_t sum = 0;
 
    for (uint8_t i = 0; i < samples; i++)
@@ -843,4 +2094,55 @@ uint16_t AMController::avg_adc_read(uint8_t samples)
    }
 
    return (uint16_t)(sum / samples);
+}
+
+/**
+ * Samples input in the background, see ADCSampler. While it runs adc_read() and adc_select_input() must not be used.
+ */
+bool AMController::adc_sampler_start(uint input, uint32_t sample_rate, adc_block_callback_t block_callback)
+{
+    return adc_sampler.start(input, sample_rate, block_callback);
+}
+
+/**
+ * Samples the inputs in input_mask (bit n for input n) in round robin, filtered as set by adc_set_filter().
+ * Their values are read with adc_value(), e.g. to_voltage(adc_value(2), 3.3).
+ */
+bool AMController::adc_sampler_start_inputs(uint input_mask, uint32_t sample_rate, adc_block_callback_t block_callback)
+{
+    return adc_sampler.start_inputs(input_mask, sample_rate, block_callback);
+}
+
+void AMController::adc_sampler_stop()
+{
+    adc_sampler.stop();
+}
+
+/**
+ * Average of the last block of samples. Meant for a single input: with adc_sampler_start_inputs()
+ * it blends all the inputs, use adc_value() for each of them.
+ */
+uint16_t AMController::adc_sampler_average()
+{
+    return adc_sampler.get_average();
+}
+
+bool AMController::adc_set_filter(uint input, adc_filter_type_t type, uint8_t param)
+{
+    return adc_sampler.set_filter(input, type, param);
+}
+
+uint16_t AMController::adc_value(uint input)
+{
+    return adc_sampler.get_value(input);
+}
+
+void AMController::get_adc_sampler_stats(adc_sampler_stats_t *stats)
+{
+    adc_sampler.get_stats(stats);
+}
+
+void AMController::reset_adc_sampler_stats()
+{
+    adc_sampler.reset_stats();
 }
\ No newline at end of file
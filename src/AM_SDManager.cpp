@@ -1,5 +1,7 @@
 #include "AM_SDManager.h"
 
+#include <strings.h>
+
 #include "AM_SDK_PicoBle.h"
 
 #include "f_util.h"
@@ -11,9 +13,39 @@
 #define SD_DEBUG_printf
 #endif
 
+// The volume is mounted once and shared by all the SD operations: files kept open by a
+// transfer stay valid while logs are written (see suspend_transfer() for the file of the transfer itself).
+// Each successful sd_mount() needs an sd_unmount().
+static FATFS fs;
+static int mount_count;
+
+FRESULT sd_mount()
+{
+    if (mount_count == 0)
+    {
+        FRESULT fr = f_mount(&fs, "", 1);
+        if (fr != FR_OK)
+        {
+            return fr;
+        }
+    }
+    mount_count++;
+
+    return FR_OK;
+}
+
+void sd_unmount()
+{
+    if (mount_count > 0 && --mount_count == 0)
+    {
+        f_unmount("");
+    }
+}
+
 SDManager::SDManager(AMController *pico)
 {
     this->pico = pico;
+    transfer.type = TRANSFER_NONE;
 }
 
 bool SDManager::endsWith(const char *base, const char *str)
@@ -27,139 +59,127 @@ bool SDManager::endsWith(const char *base, const char *str)
     return false;
 }
 
-int SDManager::dir(char *last_file_sent)
+/**
+ * Sends the list of the log files, one SD message each, then $EFL$.
+ * Returns -1 if the transfer has to be resumed when messages can be sent again, 0 when completed.
+ */
+int SDManager::dir()
 {
-    FATFS fs;
     FRESULT fr;
-    DIR dir;
-    FILINFO fno;
-    FRESULT res;
 
-    fr = f_mount(&fs, "", 1);
-    if (fr != FR_OK)
+    if (transfer.type != TRANSFER_DIR)
     {
-        SD_DEBUG_printf("SD not mounted - error: %s (%d)\n", FRESULT_str(fr), fr);
-        return 0;
-    }
-
-    SD_DEBUG_printf("SD mounted\n");
+        if (!begin_transfer(TRANSFER_DIR, "/"))
+        {
+            return 0;
+        }
 
-    fr = f_findfirst(&dir, &fno, "/", "*");
-    if (FR_OK != fr)
-    {
-        SD_DEBUG_printf("f_open(%s) error: %s (%d)\n", "/", FRESULT_str(fr), fr);
-        return 0;
-    }
+        SD_DEBUG_printf("SD mounted\n");
 
-    if (strlen(last_file_sent) > 0)
-    {
-        while (fr == FR_OK && fno.fname[0])
+        fr = f_findfirst(&transfer.dir, &transfer.fno, "/", "*");
+        if (FR_OK != fr)
         {
-            if (fno.fname[0] != '.' && endsWith(fno.fname, ".txt"))
-            {
-                if (strcmp(fno.fname, last_file_sent) == 0)
-                {
-                    break;
-                }
-                SD_DEBUG_printf("\tAlready Sent %s\n", fno.fname);
-            }
-            fr = f_findnext(&dir, &fno); /* Search for next item */
+            SD_DEBUG_printf("f_open(%s) error: %s (%d)\n", "/", FRESULT_str(fr), fr);
+            end_transfer();
+            return 0;
         }
     }
 
-    while (fr == FR_OK && fno.fname[0])
+    // transfer.fno is the next entry to send, kept when the transfer stalls
+    while (transfer.fno.fname[0])
     {
-        if (fno.fname[0] != '.' && endsWith(fno.fname, ".txt"))
+        if (transfer.fno.fname[0] != '.' && endsWith(transfer.fno.fname, ".txt"))
         {
-            SD_DEBUG_printf("Dir - Sending %s\n", fno.fname);
+            SD_DEBUG_printf("Dir - Sending %s\n", transfer.fno.fname);
             if (!pico->can_send_message())
             {
-                SD_DEBUG_printf("File cannot be sent [Last Sent: %s]\n", last_file_sent);
+                SD_DEBUG_printf("File cannot be sent [Next: %s]\n", transfer.fno.fname);
                 return -1;
             }
-            strcpy(last_file_sent, fno.fname);
-            pico->notifiy_message("SD",fno.fname);
+            pico->notifiy_message("SD", transfer.fno.fname);
+        }
+
+        fr = f_findnext(&transfer.dir, &transfer.fno); /* Search for next item */
+        if (fr != FR_OK)
+        {
+            transfer.fno.fname[0] = '\0';
         }
-        fr = f_findnext(&dir, &fno); /* Search for next item */
     }
 
-    if (!pico->can_send_message()) {
+    if (!pico->can_send_message())
+    {
         return -1;
     }
 
     SD_DEBUG_printf("Dir - Sending end of list\n");
     pico->notifiy_message("SD", "$EFL$");
 
-    f_closedir(&dir);
-    f_unmount("");
+    end_transfer();
 
     return 0;
 }
 
-int SDManager::transmit_file(char *filename,  int *already_read_bytes)
+/**
+ * Sends the content of filename: $C$, the content in chunks as large as the MTU allows, then $E$.
+ * Returns -1 if the transfer has to be resumed when messages can be sent again, 0 when completed.
+ */
+int SDManager::transmit_file(const char *filename)
 {
-    FATFS fs;
     FRESULT fr;
-    DIR dir;
-    FILINFO fno;
-    FRESULT res;
-    FIL fil;
-    char buffer[64];
-
-    SD_DEBUG_printf("Sending file %s\n", filename);
 
-    fr = f_mount(&fs, "", 1);
-    if (fr != FR_OK)
+    if (transfer.type != TRANSFER_FILE)
     {
-        SD_DEBUG_printf("Device not mounted - error: %s (%d)\n", FRESULT_str(fr), fr);
-        return 0;
-    }
+        SD_DEBUG_printf("Sending file %s\n", filename);
 
-    fr = f_open(&fil, filename, FA_OPEN_EXISTING | FA_READ);
-    if (fr != FR_OK)
-    {
-        SD_DEBUG_printf("Error opening file %s - error: %s (%d)\n", filename, FRESULT_str(fr), fr);
-        return 0;
-    }
+        if (!begin_transfer(TRANSFER_FILE, filename))
+        {
+            return 0;
+        }
+
+        fr = f_open(&transfer.fil, filename, FA_OPEN_EXISTING | FA_READ);
+        if (fr != FR_OK)
+        {
+            SD_DEBUG_printf("Error opening file %s - error: %s (%d)\n", filename, FRESULT_str(fr), fr);
+            end_transfer();
+            return 0;
+        }
+        transfer.file_open = true;
 
-    if (*already_read_bytes == 0) {
         pico->write_message_immediate("SD", "$C$");
     }
-    else {
-        f_lseek(&fil, *already_read_bytes);
-    }
 
-    //int chunk = 0;
-    while (!f_eof(&fil))
+    while (true)
     {
-        uint size;
-        fr = f_read(&fil, &buffer, sizeof(buffer), &size);
-        if (fr != FR_OK)
+        // A chunk not sent when the transfer stalled is kept in the buffer
+        if (transfer.pending_size == 0)
         {
-            f_close(&fil);
-            f_unmount("");
+            if (!transfer.file_open || f_eof(&transfer.fil))
+            {
+                break;
+            }
 
-            return 0;
+            fr = f_read(&transfer.fil, transfer.buffer, pico->max_payload_size(), &transfer.pending_size);
+            if (fr != FR_OK)
+            {
+                end_transfer();
+                return 0;
+            }
+            SD_DEBUG_printf("\tBuffer %.*s\n", (int)transfer.pending_size, transfer.buffer);
         }
-        SD_DEBUG_printf("\tBuffer %s\n", buffer);
 
-        if (!pico->can_send_message())
+        if (!pico->can_send_message() || !pico->notify_buffer(transfer.buffer, transfer.pending_size))
         {
-            DEBUG_printf("File %s not yet completed\n", filename);
-            f_close(&fil);
-            f_unmount("");
+            DEBUG_printf("File %s not yet completed\n", transfer.name);
             return -1;
         }
-
-        pico->notify_buffer(buffer, size);
-        *already_read_bytes += size;
+        transfer.pending_size = 0;
     }
+
     pico->write_message_immediate("SD", "$E$");
 
-    SD_DEBUG_printf("\nFile %s completed\n", filename);
+    SD_DEBUG_printf("\nFile %s completed\n", transfer.name);
 
-    f_close(&fil);
-    f_unmount("");
+    end_transfer();
 
     return 0;
 }
@@ -190,39 +210,55 @@ bool SDManager::append(char *filename, uint8_t *byte, unsigned int size)
     return (written_bytes == size);
 }
 
-void SDManager::sd_log_labels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4, const char *label5)
+/**
+ * Writes the labels if the log is empty. If size is not NULL it gets the size of the log.
+ */
+bool SDManager::sd_log_labels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4, const char *label5, FSIZE_t *size)
 {
-    FATFS fs;
     FRESULT fr;
     DIR dir;
     FILINFO fno;
     FRESULT res;
     FIL fil;
 
-    fr = f_mount(&fs, "", 1);
+    fr = sd_mount();
     if (fr != FR_OK)
     {
         SD_DEBUG_printf("Device not mounted - error: %s (%d)\n", FRESULT_str(fr), fr);
-        return;
+        return false;
     }
 
     char filename[64];
-    strcpy(filename, "/");
-    strcat(filename, variable);
-    strcat(filename, ".txt");
+    snprintf(filename, sizeof(filename), "/%s.txt", variable);
+
+    bool suspended = suspend_transfer(filename);
 
     fr = f_open(&fil, filename, FA_OPEN_APPEND | FA_WRITE);
     if (fr != FR_OK)
     {
         SD_DEBUG_printf("Error opening file %s (%d)\n", FRESULT_str(fr), fr);
-        return;
+        if (suspended)
+        {
+            resume_transfer(filename);
+        }
+        sd_unmount();
+        return false;
     }
 
     if (f_size(&fil) > 0)
     {
         SD_DEBUG_printf("No Labels required for %s\n", filename);
+        if (size != NULL)
+        {
+            *size = f_size(&fil);
+        }
         f_close(&fil);
-        return;
+        if (suspended)
+        {
+            resume_transfer(filename);
+        }
+        sd_unmount();
+        return true;
     }
 
     f_printf(&fil, "-;%s;", label1);
@@ -263,9 +299,20 @@ void SDManager::sd_log_labels(const char *variable, const char *label1, const ch
         f_printf(&fil, "-\n");
     }
 
+    if (size != NULL)
+    {
+        *size = f_size(&fil);
+    }
     f_close(&fil);
 
-    f_unmount("");
+    if (suspended)
+    {
+        resume_transfer(filename);
+    }
+
+    sd_unmount();
+
+    return true;
 }
 
 void SDManager::log_value(const char *variable, unsigned long time, float v1)
@@ -293,32 +340,39 @@ void SDManager::log_value(const char *variable, unsigned long time, float v1, fl
     log_values(variable, time, &v1, &v2, &v3, &v4, &v5);
 }
 
-void SDManager::log_values(const char *variable, unsigned long time, float *v1, float *v2, float *v3, float *v4, float *v5)
+/**
+ * Appends a line to the log. If size is not NULL it gets the size of the log.
+ */
+bool SDManager::log_values(const char *variable, unsigned long time, float *v1, float *v2, float *v3, float *v4, float *v5, FSIZE_t *size)
 {
-    FATFS fs;
     FRESULT fr;
     DIR dir;
     FILINFO fno;
     FRESULT res;
     FIL fil;
 
-    fr = f_mount(&fs, "", 1);
+    fr = sd_mount();
     if (fr != FR_OK)
     {
         SD_DEBUG_printf("Device not mounted - error: %s (%d)\n", FRESULT_str(fr), fr);
-        return;
+        return false;
     }
 
     char filename[64];
-    strcpy(filename, "/");
-    strcat(filename, variable);
-    strcat(filename, ".txt");
+    snprintf(filename, sizeof(filename), "/%s.txt", variable);
+
+    bool suspended = suspend_transfer(filename);
 
     fr = f_open(&fil, filename, FA_OPEN_APPEND | FA_WRITE);
     if (fr != FR_OK)
     {
         SD_DEBUG_printf("Error opening file %s (%d)\n", FRESULT_str(fr), fr);
-        return;
+        if (suspended)
+        {
+            resume_transfer(filename);
+        }
+        sd_unmount();
+        return false;
     }
 
     f_printf(&fil, "%lu;%f;", time, *v1);
@@ -359,21 +413,31 @@ void SDManager::log_values(const char *variable, unsigned long time, float *v1,
         f_printf(&fil, "-\n");
     }
 
+    if (size != NULL)
+    {
+        *size = f_size(&fil);
+    }
     f_close(&fil);
 
-    f_unmount("");
+    if (suspended)
+    {
+        resume_transfer(filename);
+    }
+
+    sd_unmount();
+
+    return true;
 }
 
 FSIZE_t SDManager::sd_log_size(const char *variable)
 {
-    FATFS fs;
     FRESULT fr;
     DIR dir;
     FILINFO fno;
     FRESULT res;
     FIL fil;
 
-    fr = f_mount(&fs, "", 1);
+    fr = sd_mount();
     if (fr != FR_OK)
     {
         SD_DEBUG_printf("Device not mounted - error: %s (%d)\n", FRESULT_str(fr), fr);
@@ -381,44 +445,52 @@ FSIZE_t SDManager::sd_log_size(const char *variable)
     }
 
     char filename[64];
-    strcpy(filename, "/");
-    strcat(filename, variable);
-    strcat(filename, ".txt");
+    snprintf(filename, sizeof(filename), "/%s.txt", variable);
+
+    bool suspended = suspend_transfer(filename);
 
     fr = f_open(&fil, filename, FA_OPEN_APPEND | FA_WRITE);
     if (fr != FR_OK)
     {
         SD_DEBUG_printf("Error opening file %s (%d)\n", FRESULT_str(fr), fr);
+        if (suspended)
+        {
+            resume_transfer(filename);
+        }
+        sd_unmount();
         return 0;
     }
     FSIZE_t size = f_size(&fil);
 
     f_close(&fil);
-    f_unmount("");
+    if (suspended)
+    {
+        resume_transfer(filename);
+    }
+    sd_unmount();
 
     return size;
 }
 
-void SDManager::sd_purge_data(const char *variable)
+bool SDManager::sd_purge_data(const char *variable)
 {
-    FATFS fs;
     FRESULT fr;
     DIR dir;
     FILINFO fno;
     FRESULT res;
     FIL fil;
 
-    fr = f_mount(&fs, "", 1);
+    fr = sd_mount();
     if (fr != FR_OK)
     {
         SD_DEBUG_printf("Device not mounted - error: %s (%d)\n", FRESULT_str(fr), fr);
-        return;
+        return false;
     }
 
     char filename[64];
-    strcpy(filename, "/");
-    strcat(filename, variable);
-    strcat(filename, ".txt");
+    snprintf(filename, sizeof(filename), "/%s.txt", variable);
+
+    bool suspended = suspend_transfer(filename);
 
     fr = f_unlink(filename);
     if (fr != FR_OK)
@@ -426,38 +498,51 @@ void SDManager::sd_purge_data(const char *variable)
         SD_DEBUG_printf("Error deleting: %s - %s (%d)\n", filename, FRESULT_str(fr), fr);
     }
 
-    f_unmount("");
+    if (suspended)
+    {
+        resume_transfer(filename);
+    }
+
+    sd_unmount();
+
+    return fr == FR_OK;
 }
 
-void SDManager::sd_purge_data_keeping_labels(const char *variable)
+/**
+ * Keeps only the labels of the log. If size is not NULL it gets the size of the log.
+ */
+bool SDManager::sd_purge_data_keeping_labels(const char *variable, FSIZE_t *size)
 {
-    FATFS fs;
     FRESULT fr;
     DIR dir;
     FILINFO fno;
     FRESULT res;
     FIL fil;
 
-    fr = f_mount(&fs, "", 1);
+    fr = sd_mount();
     if (fr != FR_OK)
     {
         SD_DEBUG_printf("Device not mounted - error: %s (%d)\n", FRESULT_str(fr), fr);
-        return;
+        return false;
     }
 
     char filename[64];
-    strcpy(filename, "/");
-    strcat(filename, variable);
-    strcat(filename, ".txt");
+    snprintf(filename, sizeof(filename), "/%s.txt", variable);
 
     SD_DEBUG_printf("Purging Keeping Label for %s\n", filename);
 
+    bool suspended = suspend_transfer(filename);
+
     fr = f_open(&fil, filename, FA_OPEN_EXISTING | FA_READ | FA_WRITE);
     if (fr != FR_OK)
     {
         SD_DEBUG_printf("Error opening file : %s (%d)\n", FRESULT_str(fr), fr);
-        f_unmount("");
-        return;
+        if (suspended)
+        {
+            resume_transfer(filename);
+        }
+        sd_unmount();
+        return false;
     }
 
     char line[128];
@@ -472,77 +557,246 @@ void SDManager::sd_purge_data_keeping_labels(const char *variable)
     {
         SD_DEBUG_printf("Error truncating file : %s (%d)\n", FRESULT_str(fr), fr);
         f_close(&fil);
-        f_unmount("");
-        return;
+        if (suspended)
+        {
+            resume_transfer(filename);
+        }
+        sd_unmount();
+        return false;
     }
 
+    if (size != NULL)
+    {
+        *size = f_size(&fil);
+    }
     f_close(&fil);
-    f_unmount("");
+    if (suspended)
+    {
+        resume_transfer(filename);
+    }
+    sd_unmount();
+
+    return true;
 }
 
-int SDManager::sd_send_log_data(const char *value, int *already_read_bytes)
+/**
+ * Sends the lines of the log of variable as <variable>=<line> messages, one line per notification, then an empty one.
+ * Returns -1 if the transfer has to be resumed when messages can be sent again, 0 when completed.
+ */
+int SDManager::sd_send_log_data(const char *variable)
 {
-    DEBUG_printf("Sending Logging file for variable: %s\n", value);
-
-    FATFS fs;
     FRESULT fr;
-    DIR dir;
-    FILINFO fno;
-    FRESULT res;
-    FIL fil;
 
-    fr = f_mount(&fs, "", 1);
-    if (fr != FR_OK)
+    if (transfer.type != TRANSFER_LOG)
     {
-        SD_DEBUG_printf("Device not mounted - error: %s (%d)\n", FRESULT_str(fr), fr);
-        pico->write_message_immediate(value, "");
-        return 0;
-    }
+        DEBUG_printf("Sending Logging file for variable: %s\n", variable);
 
-    char filename[64];
-    strcpy(filename, "/");
-    strcat(filename, value);
-    strcat(filename, ".txt");
+        if (!begin_transfer(TRANSFER_LOG, variable))
+        {
+            pico->write_message_immediate(variable, "");
+            return 0;
+        }
 
-    SD_DEBUG_printf("Sending Log File %s\n", filename);
+        char filename[64];
+        snprintf(filename, sizeof(filename), "/%s.txt", variable);
 
-    fr = f_open(&fil, filename, FA_OPEN_EXISTING | FA_READ);
-    if (fr != FR_OK)
-    {
-        SD_DEBUG_printf("Error opening file : %s (%d)\n", FRESULT_str(fr), fr);
-        pico->write_message_immediate(value, "");
-        f_unmount("");
-        return 0;
-    }
+        SD_DEBUG_printf("Sending Log File %s\n", filename);
 
-    if (*already_read_bytes > 0)
-    {
-        f_lseek(&fil, *already_read_bytes);
+        fr = f_open(&transfer.fil, filename, FA_OPEN_EXISTING | FA_READ);
+        if (fr != FR_OK)
+        {
+            SD_DEBUG_printf("Error opening file : %s (%d)\n", FRESULT_str(fr), fr);
+            pico->write_message_immediate(variable, "");
+            end_transfer();
+            return 0;
+        }
+        transfer.file_open = true;
     }
 
-    char line[128];
-    while (!f_eof(&fil))
+    transfer.waiting_mtu = false;
+
+    while (true)
     {
-        f_gets(line, 128, &fil);
-        *already_read_bytes += strlen(line);
-        DEBUG_printf("%s\n", line);
+        // A line not sent when the transfer stalled is kept in the buffer
+        if (transfer.pending_size == 0)
+        {
+            if (!transfer.file_open || f_eof(&transfer.fil) || f_gets(transfer.buffer, SD_LOG_LINE_SIZE, &transfer.fil) == NULL)
+            {
+                break;
+            }
+            transfer.pending_size = strlen(transfer.buffer);
+            DEBUG_printf("%s\n", transfer.buffer);
+        }
+
+        // The device reads each notification as a record: <variable>=<line># is never split
+        int max_line_size = (int)pico->max_payload_size() - (int)strlen(transfer.name) - 2;
+        if ((int)transfer.pending_size > max_line_size)
+        {
+            // The device usually negotiates a larger MTU right after connecting
+            if (is_nil_time(transfer.mtu_deadline))
+            {
+                transfer.mtu_deadline = make_timeout_time_ms(SD_LOG_MTU_WAIT_MS);
+            }
+            if (pico->max_payload_size() < ATT_MAX_PAYLOAD_SIZE && !time_reached(transfer.mtu_deadline))
+            {
+                DEBUG_printf("Log %s waits for a larger MTU\n", transfer.name);
+                transfer.waiting_mtu = true;
+                return -1;
+            }
+
+            // The MTU does not grow: the line is shortened, still sent as a single record
+            transfer.pending_size = MAX(max_line_size, 0);
+            transfer.buffer[transfer.pending_size] = '\0';
+        }
 
         if (!pico->can_send_message())
         {
-            DEBUG_printf("File %s not yet completed\n", filename);
-            f_close(&fil);
-            f_unmount("");
+            DEBUG_printf("Log %s not yet completed\n", transfer.name);
             return -1;
         }
 
-        pico->notifiy_message(value, line);
+        pico->notifiy_message(transfer.name, transfer.buffer);
+        transfer.pending_size = 0;
     }
 
-    pico->write_message_immediate(value, "");
-    f_close(&fil);
-    f_unmount("");
+    pico->write_message_immediate(transfer.name, "");
+
+    SD_DEBUG_printf("Log File %s sent\n", transfer.name);
 
-    SD_DEBUG_printf("Log File %s sent\n", filename);
+    end_transfer();
 
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Mounts the volume and resets the transfer state. A transfer still open is closed first.
+ */
+bool SDManager::begin_transfer(uint8_t type, const char *name)
+{
+    end_transfer();
+
+    FRESULT fr = sd_mount();
+    if (fr != FR_OK)
+    {
+        SD_DEBUG_printf("SD not mounted - error: %s (%d)\n", FRESULT_str(fr), fr);
+        return false;
+    }
+
+    transfer.type = type;
+    transfer.file_open = false;
+    transfer.pending_size = 0;
+    transfer.waiting_mtu = false;
+    transfer.mtu_deadline = nil_time;
+    transfer.fno.fname[0] = '\0';
+    snprintf(transfer.name, sizeof(transfer.name), "%s", name);
+
+    return true;
+}
+
+void SDManager::end_transfer()
+{
+    if (transfer.type == TRANSFER_NONE)
+    {
+        return;
+    }
+
+    if (transfer.type == TRANSFER_DIR)
+    {
+        f_closedir(&transfer.dir);
+    }
+    else if (transfer.file_open)
+    {
+        f_close(&transfer.fil);
+    }
+
+    sd_unmount();
+    transfer.type = TRANSFER_NONE;
+}
+
+/**
+ * FatFs does not allow a file open for reading to be written or deleted. If the transfer in
+ * progress reads filename, its file is closed until resume_transfer(): returns true.
+ */
+bool SDManager::suspend_transfer(const char *filename)
+{
+    if (transfer.type != TRANSFER_FILE && transfer.type != TRANSFER_LOG)
+    {
+        return false;
+    }
+    if (!transfer.file_open)
+    {
+        return false;
+    }
+
+    char transfer_filename[sizeof(transfer.name) + 8];
+    if (transfer.type == TRANSFER_LOG)
+    {
+        snprintf(transfer_filename, sizeof(transfer_filename), "/%s.txt", transfer.name);
+    }
+    else
+    {
+        snprintf(transfer_filename, sizeof(transfer_filename), "%s", transfer.name);
+    }
+
+    // Both names are from the root, FatFs names are not case sensitive
+    const char *a = transfer_filename[0] == '/' ? transfer_filename + 1 : transfer_filename;
+    const char *b = filename[0] == '/' ? filename + 1 : filename;
+    if (strcasecmp(a, b) != 0)
+    {
+        return false;
+    }
+
+    SD_DEBUG_printf("Transfer of %s suspended\n", transfer.name);
+
+    transfer.position = f_tell(&transfer.fil);
+    f_close(&transfer.fil);
+    transfer.file_open = false;
+
+    return true;
+}
+
+/**
+ * Reopens the file of the transfer where it was. If it has been deleted the transfer ends
+ * with the data already read, if it has been truncated it ends at the new size.
+ */
+void SDManager::resume_transfer(const char *filename)
+{
+    FRESULT fr = f_open(&transfer.fil, filename, FA_OPEN_EXISTING | FA_READ);
+    if (fr != FR_OK)
+    {
+        SD_DEBUG_printf("Transfer of %s ended, the file is gone: %s (%d)\n", transfer.name, FRESULT_str(fr), fr);
+        return;
+    }
+    transfer.file_open = true;
+
+    // In read mode the position is clipped to the file size
+    f_lseek(&transfer.fil, transfer.position);
+}
+
+bool SDManager::is_transferring()
+{
+    return transfer.type != TRANSFER_NONE;
+}
+
+/**
+ * True if the transfer waits for a larger MTU rather than for ATT_EVENT_CAN_SEND_NOW:
+ * deadline is when it gives up waiting.
+ */
+bool SDManager::is_waiting_mtu(absolute_time_t *deadline)
+{
+    if (transfer.type != TRANSFER_LOG || !transfer.waiting_mtu)
+    {
+        return false;
+    }
+
+    *deadline = transfer.mtu_deadline;
+    return true;
+}
+
+/**
+ * Closes the transfer in progress, e.g. when the device disconnects
+ */
+void SDManager::cancel_transfer()
+{
+    end_transfer();
+}
@@ -10,8 +10,14 @@
 
 #include "ff.h"
 
+#define SD_LOG_LINE_SIZE 128    // Max length of a log line sent to the device, terminator included
+#define SD_LOG_MTU_WAIT_MS 2000 // Max wait for a larger MTU when a log line does not fit a notification
+
 class AMController;
 
+FRESULT sd_mount();
+void sd_unmount();
+
 class SDManager
 {
 public:
@@ -20,28 +26,60 @@ public:
     // void deleteFile(char *filename);
     bool append(char *filename, uint8_t *byte, unsigned int size);
 
-    void sd_log_labels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4, const char *label5);
+    bool sd_log_labels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4, const char *label5, FSIZE_t *size = NULL);
     void log_value(const char *variable, unsigned long time, float v1);
     void log_value(const char *variable, unsigned long time, float v1, float v2);
     void log_value(const char *variable, unsigned long time, float v1, float v2, float v3);
     void log_value(const char *variable, unsigned long time, float v1, float v2, float v3, float v4);
     void log_value(const char *variable, unsigned long time, float v1, float v2, float v3, float v4, float v5);
+    bool log_values(const char *variable, unsigned long time, float *v1, float *v2, float *v3, float *v4, float *v5, FSIZE_t *size = NULL);
     FSIZE_t sd_log_size(const char *variable);
-    void sd_purge_data(const char *variable);
-    void sd_purge_data_keeping_labels(const char *variable);
+    bool sd_purge_data(const char *variable);
+    bool sd_purge_data_keeping_labels(const char *variable, FSIZE_t *size = NULL);
 
-    int transmit_file(char *filename, int *already_read_bytes);
-    int sd_send_log_data(const char *value, int *already_read_bytes);
+    // Transfers to the device: called again after each stall (-1) until completed (0)
+    int transmit_file(const char *filename);
+    int sd_send_log_data(const char *variable);
+    int dir();
+
+    bool is_transferring();
+    bool is_waiting_mtu(absolute_time_t *deadline);
+    void cancel_transfer();
 
-    int dir(char *last_file_sent);
-    
 private:
     AMController *pico;
 
-    bool endsWith(const char *base, const char *str); 
-   
+    typedef enum
+    {
+        TRANSFER_NONE,
+        TRANSFER_DIR,
+        TRANSFER_FILE,
+        TRANSFER_LOG
+    } transfer_type_t;
 
-    void log_values(const char *variable, unsigned long time, float *v1, float *v2, float *v3, float *v4, float *v5);
+    // Transfer in progress: the file or directory stays open, and the chunk or line
+    // not yet sent stays in the buffer, while waiting for the device
+    struct
+    {
+        uint8_t type;                          // transfer_type_t
+        char name[128];                        // File name, or variable of the log
+        bool file_open;
+        FIL fil;
+        FSIZE_t position;                      // Read position while the file is closed by suspend_transfer()
+        DIR dir;
+        FILINFO fno;                           // Next directory entry to send
+        char buffer[ATT_MAX_PAYLOAD_SIZE + 1]; // File chunk or log line not yet sent
+        UINT pending_size;
+        bool waiting_mtu;                      // The log line does not fit the current MTU
+        absolute_time_t mtu_deadline;          // Until when a larger MTU is waited for, nil_time before
+    } transfer;
+
+    bool begin_transfer(uint8_t type, const char *name);
+    void end_transfer();
+    bool suspend_transfer(const char *filename);
+    void resume_transfer(const char *filename);
+
+    bool endsWith(const char *base, const char *str); 
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,328 @@
+#include "AM_SDWorker.h"
+
+#include <string.h>
+
+#include "pico/multicore.h"
+
+#include "AM_SDManager.h"
+
+static SDWorker *core1_worker;
+static uint32_t core1_stack[SD_CORE1_STACK_SIZE / sizeof(uint32_t)];
+
+SDWorker::SDWorker()
+{
+    sd_manager = NULL;
+    running = false;
+    memset(&stats, 0, sizeof(stats));
+    memset(log_sizes, 0, sizeof(log_sizes));
+    next_log_size = 0;
+}
+
+void SDWorker::start(SDManager *sd_manager)
+{
+    if (running)
+    {
+        return;
+    }
+
+    this->sd_manager = sd_manager;
+    core1_worker = this;
+    running = true;
+
+    multicore_launch_core1_with_stack(&SDWorker::core1_entry, core1_stack, sizeof(core1_stack));
+}
+
+bool SDWorker::is_running()
+{
+    return running;
+}
+
+bool SDWorker::log_labels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4, const char *label5)
+{
+    const char *labels[] = {label1, label2, label3, label4, label5};
+
+    size_t size = 0;
+    uint8_t count = 0;
+    while (count < 5 && labels[count] != NULL)
+    {
+        size += strlen(labels[count]) + 1;
+        count++;
+    }
+
+    if (size > SD_COMMAND_LABELS_SIZE)
+    {
+        stats.dropped_too_long++;
+        return false;
+    }
+
+    sd_command_t *command = begin_command(SD_LOG_LABELS, variable);
+    if (command == NULL)
+    {
+        return false;
+    }
+
+    char *p = command->labels;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        strcpy(p, labels[i]);
+        p += strlen(p) + 1;
+    }
+    command->count = count;
+
+    submit_command();
+
+    return true;
+}
+
+bool SDWorker::log_values(const char *variable, unsigned long time, const float *values, uint8_t count)
+{
+    sd_command_t *command = begin_command(SD_LOG_VALUES, variable);
+    if (command == NULL)
+    {
+        return false;
+    }
+
+    command->log.time = time;
+    memcpy(command->log.values, values, count * sizeof(float));
+    command->count = count;
+
+    submit_command();
+
+    return true;
+}
+
+bool SDWorker::purge(const char *variable, bool keep_labels)
+{
+    sd_command_t *command = begin_command(keep_labels ? SD_PURGE_KEEPING_LABELS : SD_PURGE, variable);
+    if (command == NULL)
+    {
+        return false;
+    }
+
+    submit_command();
+
+    return true;
+}
+
+/**
+ * Asks core 1 for the size of the log of variable, see get_log_size()
+ */
+bool SDWorker::query_log_size(const char *variable)
+{
+    sd_command_t *command = begin_command(SD_LOG_SIZE, variable);
+    if (command == NULL)
+    {
+        return false;
+    }
+
+    submit_command();
+
+    return true;
+}
+
+bool SDWorker::get_log_size(const char *variable, unsigned long *size)
+{
+    process_completions();
+
+    for (int i = 0; i < SD_LOG_SIZES; i++)
+    {
+        if (log_sizes[i].variable[0] != '\0' && strcmp(log_sizes[i].variable, variable) == 0)
+        {
+            *size = log_sizes[i].size;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void SDWorker::process_completions()
+{
+    sd_completion_t *completion;
+    bool popped = false;
+
+    while ((completion = completions.front()) != NULL)
+    {
+        stats.completed++;
+        if (!completion->ok)
+        {
+            stats.failed++;
+        }
+        if (completion->has_size)
+        {
+            store_log_size(completion->variable, completion->size);
+        }
+        completions.pop();
+        popped = true;
+    }
+
+    if (popped)
+    {
+        __sev(); // Wakes up core 1 if it waits for a free completion
+    }
+}
+
+void SDWorker::store_log_size(const char *variable, unsigned long size)
+{
+    log_size_t *entry = NULL;
+    for (int i = 0; i < SD_LOG_SIZES && entry == NULL; i++)
+    {
+        if (strcmp(log_sizes[i].variable, variable) == 0)
+        {
+            entry = &log_sizes[i];
+        }
+    }
+
+    if (entry == NULL)
+    {
+        entry = &log_sizes[next_log_size];
+        next_log_size = (next_log_size + 1) % SD_LOG_SIZES;
+        strcpy(entry->variable, variable);
+    }
+
+    entry->size = size;
+}
+
+void SDWorker::flush()
+{
+    process_completions();
+
+    while (stats.completed != stats.submitted)
+    {
+        // Core 1 signals each completion, the timeout covers an event consumed elsewhere
+        best_effort_wfe_or_timeout(make_timeout_time_ms(SD_FLUSH_WAIT_MS));
+        process_completions();
+    }
+}
+
+void SDWorker::get_stats(sd_worker_stats_t *stats)
+{
+    process_completions();
+    *stats = this->stats;
+}
+
+void SDWorker::reset_stats()
+{
+    flush();
+    memset(&stats, 0, sizeof(stats));
+}
+
+/**
+ * Returns the slot of the next command, NULL if the command cannot be queued
+ */
+SDWorker::sd_command_t *SDWorker::begin_command(uint8_t type, const char *variable)
+{
+    if (strlen(variable) >= SD_COMMAND_NAME_SIZE)
+    {
+        stats.dropped_too_long++;
+        return NULL;
+    }
+
+    sd_command_t *command = commands.back();
+    if (command == NULL)
+    {
+        stats.dropped_full++;
+        return NULL;
+    }
+
+    command->type = type;
+    command->count = 0;
+    strcpy(command->variable, variable);
+
+    return command;
+}
+
+void SDWorker::submit_command()
+{
+    commands.push();
+    __sev(); // Wakes up core 1
+
+    stats.submitted++;
+    stats.high_water_mark = MAX(stats.high_water_mark, (uint16_t)commands.count());
+}
+
+void SDWorker::core1_entry()
+{
+    core1_worker->run();
+}
+
+void SDWorker::run()
+{
+    while (true)
+    {
+        sd_command_t *command = commands.front();
+        if (command == NULL)
+        {
+            __wfe(); // Woken up by submit_command()
+            continue;
+        }
+
+        FSIZE_t size = 0;
+        bool has_size = false;
+        bool ok = execute(command, &size, &has_size);
+
+        sd_completion_t *completion;
+        while ((completion = completions.back()) == NULL)
+        {
+            __wfe(); // Core 0 has not collected the completions yet
+        }
+        completion->ok = ok;
+        completion->has_size = has_size;
+        completion->size = size;
+        strcpy(completion->variable, command->variable);
+        commands.pop();
+        completions.push();
+        __sev();
+    }
+}
+
+/**
+ * Sent back with the completion, so that log_size() does not wait for core 1: has_size is set
+ * when size is the size of the log once the command is executed. The size is read from the file
+ * the command already has open, or known without reading the card.
+ */
+bool SDWorker::execute(sd_command_t *command, FSIZE_t *size, bool *has_size)
+{
+    switch (command->type)
+    {
+    case SD_LOG_LABELS:
+    {
+        const char *labels[5] = {NULL, NULL, NULL, NULL, NULL};
+        const char *p = command->labels;
+        for (uint8_t i = 0; i < command->count; i++)
+        {
+            labels[i] = p;
+            p += strlen(p) + 1;
+        }
+        *has_size = sd_manager->sd_log_labels(command->variable, labels[0], labels[1], labels[2], labels[3], labels[4], size);
+        return *has_size;
+    }
+
+    case SD_LOG_VALUES:
+    {
+        float *values[5] = {NULL, NULL, NULL, NULL, NULL};
+        for (uint8_t i = 0; i < command->count; i++)
+        {
+            values[i] = &command->log.values[i];
+        }
+        *has_size = sd_manager->log_values(command->variable, command->log.time, values[0], values[1], values[2], values[3], values[4], size);
+        return *has_size;
+    }
+
+    case SD_PURGE:
+        *size = 0; // Also when the log did not exist
+        *has_size = true;
+        return sd_manager->sd_purge_data(command->variable);
+
+    case SD_PURGE_KEEPING_LABELS:
+        *has_size = sd_manager->sd_purge_data_keeping_labels(command->variable, size);
+        return *has_size;
+
+    case SD_LOG_SIZE:
+        *size = sd_manager->sd_log_size(command->variable);
+        *has_size = true;
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,131 @@
+#ifndef AM_SDWORKER_H
+#define AM_SDWORKER_H
+
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+
+#include "AM_Queue.h"
+
+#include "ff.h"
+
+#define SD_COMMANDS_QUEUE_SIZE 16  // Max number of SD commands waiting for core 1 (power of 2)
+#define SD_COMMAND_NAME_SIZE 32    // Max length of a logged variable name, terminator included
+#define SD_COMMAND_LABELS_SIZE 96  // Max length of the labels of a log, terminators included
+#define SD_CORE1_STACK_SIZE 8192   // FatFs keeps FATFS and FIL objects on the stack
+#define SD_LOG_SIZES 4             // Logs whose size is kept for log_size()
+#define SD_FLUSH_WAIT_MS 10        // Max wait of flush() between two checks of the completions
+
+// SD commands statistics
+typedef struct
+{
+    uint32_t submitted;        // Commands queued for core 1
+    uint32_t completed;        // Commands executed by core 1
+    uint32_t failed;           // Completed commands whose SD operation failed
+    uint32_t dropped_full;     // Commands discarded because the queue was full
+    uint32_t dropped_too_long; // Commands discarded because the name or the labels do not fit
+    uint16_t high_water_mark;  // Max number of commands pending at the same time
+} sd_worker_stats_t;
+
+class SDManager;
+
+/**
+ * Runs the SD card writes of the logs on core 1.
+ *
+ * Core 0 queues a command and returns at once, core 1 executes the commands in order
+ * and queues back their completions. Both queues are lock-free single producer /
+ * single consumer rings. While commands are pending core 1 owns the card: core 0
+ * must call flush() before accessing the card directly.
+ * Each completion carries the size of its log when the command knows it, kept for get_log_size().
+ * All the methods are called on core 0.
+ *
+ * The transfers to the device (dir, sd_send_log_data, transmit_file) stay on core 0:
+ * between two reads they notify over BLE, and BTstack is only called from core 0 under
+ * the async_context lock. Each step reads one chunk or line and waits for
+ * ATT_EVENT_CAN_SEND_NOW with the file left open, so it is short, and running it on core 1
+ * would only move every chunk through the queues once more.
+ */
+class SDWorker
+{
+public:
+    SDWorker();
+
+    void start(SDManager *sd_manager);
+    bool is_running();
+
+    bool log_labels(const char *variable, const char *label1, const char *label2, const char *label3, const char *label4, const char *label5);
+    bool log_values(const char *variable, unsigned long time, const float *values, uint8_t count);
+    bool purge(const char *variable, bool keep_labels);
+    bool query_log_size(const char *variable);
+
+    // Size of the log after the last command completed on it, false if unknown
+    bool get_log_size(const char *variable, unsigned long *size);
+
+    // Collects the completions sent back by core 1
+    void process_completions();
+
+    // Waits until core 1 has executed all the commands
+    void flush();
+
+    void get_stats(sd_worker_stats_t *stats);
+    void reset_stats();
+
+private:
+    typedef enum
+    {
+        SD_LOG_LABELS,
+        SD_LOG_VALUES,
+        SD_PURGE,
+        SD_PURGE_KEEPING_LABELS,
+        SD_LOG_SIZE
+    } sd_command_type_t;
+
+    typedef struct
+    {
+        uint8_t type;  // sd_command_type_t
+        uint8_t count; // Number of values or labels
+        char variable[SD_COMMAND_NAME_SIZE];
+        union
+        {
+            struct
+            {
+                unsigned long time;
+                float values[5];
+            } log;
+            char labels[SD_COMMAND_LABELS_SIZE]; // One after the other, '\0' terminated
+        };
+    } sd_command_t;
+
+    typedef struct
+    {
+        bool ok;
+        bool has_size;
+        unsigned long size; // Of the log once the command is executed, if has_size
+        char variable[SD_COMMAND_NAME_SIZE];
+    } sd_completion_t;
+
+    typedef struct
+    {
+        char variable[SD_COMMAND_NAME_SIZE]; // Empty if the entry is free
+        unsigned long size;
+    } log_size_t;
+
+    SPSCQueue<sd_command_t, SD_COMMANDS_QUEUE_SIZE> commands;       // Core 0 -> core 1
+    SPSCQueue<sd_completion_t, SD_COMMANDS_QUEUE_SIZE> completions; // Core 1 -> core 0
+
+    SDManager *sd_manager;
+    bool running;
+    sd_worker_stats_t stats;
+    log_size_t log_sizes[SD_LOG_SIZES];
+    uint8_t next_log_size; // Entry replaced when a new log is seen
+
+    sd_command_t *begin_command(uint8_t type, const char *variable);
+    void submit_command();
+
+    static void core1_entry();
+    void run();
+    bool execute(sd_command_t *command, FSIZE_t *size, bool *has_size);
+    void store_log_size(const char *variable, unsigned long size);
+};
+
+#endif
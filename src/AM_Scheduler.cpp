@@ -0,0 +1,183 @@
+#include "AM_Scheduler.h"
+
+#include <string.h>
+
+TaskScheduler::TaskScheduler()
+{
+    memset(tasks, 0, sizeof(tasks));
+    run_queue_len = 0;
+    running_task = -1;
+}
+
+/**
+ * Adds a task, run every period_ms if periodic, otherwise once after period_ms.
+ * When several tasks are due, higher priority values run first.
+ * Returns the id of the task or -1 if there are already MAX_TASKS tasks.
+ */
+int TaskScheduler::add_task(void (*task)(void), uint32_t period_ms, uint8_t priority, bool periodic)
+{
+    if (task == NULL || (periodic && period_ms == 0))
+    {
+        return -1;
+    }
+
+    for (int id = 0; id < MAX_TASKS; id++)
+    {
+        // The entry of the running task is still in use even if the task removed itself
+        if (tasks[id].task != NULL || id == running_task)
+        {
+            continue;
+        }
+
+        task_t *t = &tasks[id];
+        memset(t, 0, sizeof(task_t));
+        t->task = task;
+        t->period_us = (uint64_t)period_ms * 1000;
+        t->deadline_us = time_us_64() + t->period_us;
+        t->priority = priority;
+        t->periodic = periodic;
+
+        enqueue(id);
+
+        return id;
+    }
+
+    return -1;
+}
+
+bool TaskScheduler::remove_task(int id)
+{
+    if (id < 0 || id >= MAX_TASKS || tasks[id].task == NULL)
+    {
+        return false;
+    }
+
+    if (id != running_task)
+    {
+        dequeue(id);
+    }
+    tasks[id].task = NULL;
+
+    return true;
+}
+
+bool TaskScheduler::get_task_stats(int id, task_stats_t *stats)
+{
+    if (id < 0 || id >= MAX_TASKS || tasks[id].task == NULL)
+    {
+        return false;
+    }
+
+    *stats = tasks[id].stats;
+
+    return true;
+}
+
+void TaskScheduler::reset_task_stats(int id)
+{
+    if (id >= 0 && id < MAX_TASKS)
+    {
+        memset(&tasks[id].stats, 0, sizeof(task_stats_t));
+    }
+}
+
+int TaskScheduler::run_due_tasks()
+{
+    // Only the tasks due now: tasks getting due while these run wait for the next call,
+    // so the main loop can handle BLE messages in between
+    uint64_t now = time_us_64();
+    int count = 0;
+
+    while (true)
+    {
+        int id = -1;
+        for (int i = 0; i < run_queue_len && tasks[run_queue[i]].deadline_us <= now; i++)
+        {
+            if (id == -1 || tasks[run_queue[i]].priority > tasks[id].priority)
+            {
+                id = run_queue[i];
+            }
+        }
+
+        if (id == -1)
+        {
+            break;
+        }
+
+        task_t *t = &tasks[id];
+        dequeue(id);
+
+        uint64_t start = time_us_64();
+        running_task = id;
+        t->task();
+        running_task = -1;
+        uint64_t end = time_us_64();
+
+        uint32_t jitter = (uint32_t)(start - t->deadline_us);
+        uint32_t duration = (uint32_t)(end - start);
+
+        t->stats.runs++;
+        t->stats.total_jitter_us += jitter;
+        t->stats.max_jitter_us = MAX(t->stats.max_jitter_us, jitter);
+        t->stats.max_duration_us = MAX(t->stats.max_duration_us, duration);
+
+        count++;
+
+        if (t->task == NULL)
+        {
+            continue; // Removed while running
+        }
+
+        if (!t->periodic)
+        {
+            t->task = NULL;
+            continue;
+        }
+
+        // Skips the periods already over
+        uint64_t missed = (end - t->deadline_us) / t->period_us;
+        t->stats.overruns += (uint32_t)missed;
+        t->deadline_us += (missed + 1) * t->period_us;
+
+        enqueue(id);
+    }
+
+    return count;
+}
+
+absolute_time_t TaskScheduler::next_deadline()
+{
+    if (run_queue_len == 0)
+    {
+        return at_the_end_of_time;
+    }
+
+    return from_us_since_boot(tasks[run_queue[0]].deadline_us);
+}
+
+void TaskScheduler::enqueue(int id)
+{
+    // After the tasks with the same deadline
+    int idx = run_queue_len;
+    while (idx > 0 && tasks[run_queue[idx - 1]].deadline_us > tasks[id].deadline_us)
+    {
+        run_queue[idx] = run_queue[idx - 1];
+        idx--;
+    }
+
+    run_queue[idx] = (uint8_t)id;
+    run_queue_len++;
+}
+
+void TaskScheduler::dequeue(int id)
+{
+    for (int i = 0; i < run_queue_len; i++)
+    {
+        if (run_queue[i] == id)
+        {
+            memmove(&run_queue[i], &run_queue[i + 1], run_queue_len - i - 1);
+            run_queue_len--;
+            return;
+        }
+    }
+}
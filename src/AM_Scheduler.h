@@ -0,0 +1,65 @@
+#ifndef AM_SCHEDULER_H
+#define AM_SCHEDULER_H
+
+#include <stdio.h>
+
+#include "pico/stdlib.h"
+
+#define MAX_TASKS 16
+
+// Task execution statistics
+typedef struct
+{
+    uint32_t runs;
+    uint32_t overruns;        // Periods skipped because the task could not run in time
+    uint32_t max_jitter_us;   // Max delay between the deadline and the actual start
+    uint64_t total_jitter_us; // Average jitter is total_jitter_us / runs
+    uint32_t max_duration_us;
+} task_stats_t;
+
+/**
+ * Cooperative scheduler of periodic and one-shot tasks, run by the main loop.
+ *
+ * Tasks are kept in deadline order. When several tasks are due, the one with the
+ * highest priority runs first. Periodic tasks are scheduled on multiples of their
+ * period from the first deadline, so a late run does not shift the following ones.
+ * Tasks must not block: the BLE messages and file transfers wait for them.
+ */
+class TaskScheduler
+{
+public:
+    TaskScheduler();
+
+    int add_task(void (*task)(void), uint32_t period_ms, uint8_t priority, bool periodic);
+    bool remove_task(int id);
+
+    bool get_task_stats(int id, task_stats_t *stats);
+    void reset_task_stats(int id);
+
+    // Runs the tasks that are due, returns the number of tasks run
+    int run_due_tasks();
+
+    // Deadline of the first task, at_the_end_of_time if there are no tasks
+    absolute_time_t next_deadline();
+
+private:
+    typedef struct
+    {
+        void (*task)(void); // NULL if the entry is free
+        uint64_t period_us;
+        uint64_t deadline_us;
+        uint8_t priority;
+        bool periodic;
+        task_stats_t stats;
+    } task_t;
+
+    task_t tasks[MAX_TASKS];
+    uint8_t run_queue[MAX_TASKS]; // Tasks ids in deadline order
+    uint8_t run_queue_len;
+    int running_task;
+
+    void enqueue(int id);
+    void dequeue(int id);
+};
+
+#endif
@@ -0,0 +1,197 @@
+/*
+ * Compares the AM_Format functions with sprintf: same output, and time per call.
+ *
+ *   format_bench [values]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <chrono>
+
+#include "AM_Format.h"
+
+#define DEFAULT_VALUES 1000000
+
+static uint32_t random_state = 12345;
+
+static uint32_t random_u32()
+{
+    // xorshift32
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+// Any float, most of them outside the range of the fast path
+static float random_bits_float()
+{
+    uint32_t bits = random_u32();
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Values like the ones sent by sensors
+static float random_sensor_float()
+{
+    return ((int32_t)random_u32() % 2000000) / 100.0f;
+}
+
+static double now_ns()
+{
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Sum of the characters written: keeps the compiler from dropping the calls
+static volatile unsigned sink;
+
+typedef struct
+{
+    const char *name;
+    const char *format;
+    char *(*function)(char *buffer, float value);
+} float_format_t;
+
+static long check_long(long *values, int count)
+{
+    long mismatches = 0;
+    char expected[FORMAT_MAX_SIZE];
+    char actual[FORMAT_MAX_SIZE];
+
+    for (int i = 0; i < count; i++)
+    {
+        sprintf(expected, "%ld", values[i]);
+        format_long(actual, values[i]);
+        if (strcmp(expected, actual) != 0)
+        {
+            if (mismatches++ < 10)
+            {
+                printf("  %%ld mismatch: %s sprintf %s\n", actual, expected);
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+static long check_float(const float_format_t *f, float *values, int count)
+{
+    long mismatches = 0;
+    char expected[FORMAT_MAX_SIZE];
+    char actual[FORMAT_MAX_SIZE];
+
+    for (int i = 0; i < count; i++)
+    {
+        if (isnan(values[i]) || isinf(values[i]))
+        {
+            continue; // sprintf fallback anyway
+        }
+
+        snprintf(expected, sizeof(expected), f->format, values[i]);
+        f->function(actual, values[i]);
+        if (strcmp(expected, actual) != 0)
+        {
+            if (mismatches++ < 10)
+            {
+                printf("  %s mismatch for %a: %s sprintf %s\n", f->format, values[i], actual, expected);
+            }
+        }
+    }
+
+    return mismatches;
+}
+
+int main(int argc, char **argv)
+{
+    int count = argc > 1 ? atoi(argv[1]) : DEFAULT_VALUES;
+    if (count <= 0)
+    {
+        printf("Usage: %s [values]\n", argv[0]);
+        return 1;
+    }
+
+    long *longs = (long *)malloc(count * sizeof(long));
+    float *bits_floats = (float *)malloc(count * sizeof(float));
+    float *sensor_floats = (float *)malloc(count * sizeof(float));
+    for (int i = 0; i < count; i++)
+    {
+        longs[i] = (long)(int32_t)random_u32() >> (random_u32() % 32);
+        bits_floats[i] = random_bits_float();
+        sensor_floats[i] = random_sensor_float();
+    }
+
+    const float_format_t float_formats[] = {
+        {"format_float", "%.5g", format_float},
+        {"format_float_fixed", "%.2f", format_float_fixed},
+    };
+
+    long mismatches = check_long(longs, count);
+    for (const float_format_t &f : float_formats)
+    {
+        mismatches += check_float(&f, bits_floats, count);
+        mismatches += check_float(&f, sensor_floats, count);
+    }
+    printf("%d values per format, %ld mismatches\n\n", count, mismatches);
+
+    char buffer[FORMAT_MAX_SIZE];
+    unsigned sum = 0;
+    double start;
+
+    printf("%-32s %12s %12s\n", "", "ns/call", "sprintf");
+
+    start = now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        sum += (unsigned)(format_long(buffer, longs[i]) - buffer);
+    }
+    double format_ns = (now_ns() - start) / count;
+
+    start = now_ns();
+    for (int i = 0; i < count; i++)
+    {
+        sum += (unsigned)sprintf(buffer, "%ld", longs[i]);
+    }
+    double sprintf_ns = (now_ns() - start) / count;
+    printf("%-32s %12.1f %12.1f\n", "format_long", format_ns, sprintf_ns);
+
+    for (const float_format_t &f : float_formats)
+    {
+        const struct
+        {
+            const char *name;
+            float *values;
+        } sets[] = {{"sensor", sensor_floats}, {"any bits", bits_floats}};
+
+        for (const auto &set : sets)
+        {
+            start = now_ns();
+            for (int i = 0; i < count; i++)
+            {
+                sum += (unsigned)(f.function(buffer, set.values[i]) - buffer);
+            }
+            format_ns = (now_ns() - start) / count;
+
+            start = now_ns();
+            for (int i = 0; i < count; i++)
+            {
+                sum += (unsigned)snprintf(buffer, sizeof(buffer), f.format, set.values[i]);
+            }
+            sprintf_ns = (now_ns() - start) / count;
+
+            char name[64];
+            snprintf(name, sizeof(name), "%s (%s)", f.name, set.name);
+            printf("%-32s %12.1f %12.1f\n", name, format_ns, sprintf_ns);
+        }
+    }
+
+    sink = sum;
+
+    free(longs);
+    free(bits_floats);
+    free(sensor_floats);
+
+    return mismatches == 0 ? 0 : 1;
+}
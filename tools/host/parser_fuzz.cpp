@@ -0,0 +1,267 @@
+/*
+ * Checks MessageParser against a reference parser on random streams split at random
+ * points, then measures its throughput.
+ *
+ *   parser_fuzz [streams]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "AM_Parser.h"
+
+#define VARIABLE_LEN 14
+#define VALUE_LEN 64
+#define DEFAULT_STREAMS 20000
+#define THROUGHPUT_BYTES (64 * 1024 * 1024)
+
+typedef ParsedMessage<VARIABLE_LEN, VALUE_LEN> message_t;
+
+typedef struct
+{
+    message_t storage;
+    bool storage_available;
+    std::vector<std::string> messages; // variable=value of the completed messages
+} parser_context_t;
+
+static uint32_t random_state = 12345;
+
+static uint32_t random_u32()
+{
+    // xorshift32
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
+
+static message_t *acquire_message(void *context)
+{
+    parser_context_t *c = (parser_context_t *)context;
+    return c->storage_available ? &c->storage : NULL;
+}
+
+static void complete_message(void *context, message_t *message)
+{
+    parser_context_t *c = (parser_context_t *)context;
+    c->messages.push_back(std::string(message->variable) + "=" + message->value);
+}
+
+/**
+ * Reference: splits the whole stream on #, then applies the rules of MessageParser to each message.
+ * Overflows are counted as soon as they happen, so also in the last message if it is not complete.
+ */
+static void reference_parse(const std::string &stream, std::vector<std::string> *messages, uint32_t *overflows)
+{
+    size_t start = 0;
+
+    while (start <= stream.size())
+    {
+        size_t end = stream.find('#', start);
+        bool complete = end != std::string::npos;
+        if (!complete)
+        {
+            end = stream.size();
+        }
+
+        std::string text;
+        for (size_t i = start; i < end; i++)
+        {
+            if (stream[i] != '\0')
+            {
+                text += stream[i];
+            }
+        }
+        start = end + 1;
+
+        size_t equal = text.find('=');
+        std::string variable = text.substr(0, equal);
+        if (variable.size() > VARIABLE_LEN)
+        {
+            (*overflows)++;
+            continue;
+        }
+        if (equal == std::string::npos)
+        {
+            continue; // No value: ignored
+        }
+        if (text.size() - equal - 1 > VALUE_LEN)
+        {
+            (*overflows)++;
+            continue;
+        }
+        if (complete)
+        {
+            messages->push_back(text);
+        }
+    }
+}
+
+static std::string random_stream()
+{
+    static const char alphabet[] = "abcXYZ019$.-=#";
+
+    std::string stream;
+    int messages = random_u32() % 8;
+    for (int m = 0; m < messages; m++)
+    {
+        switch (random_u32() % 4)
+        {
+        case 0:
+        {
+            // Random bytes, # and = included
+            int len = random_u32() % 40;
+            for (int i = 0; i < len; i++)
+            {
+                stream += alphabet[random_u32() % (sizeof(alphabet) - 1)];
+            }
+            break;
+        }
+
+        case 1:
+            // NUL bytes, as sent by some devices
+            stream += std::string(1 + random_u32() % 3, '\0');
+            break;
+
+        default:
+        {
+            // Well formed message, sometimes too long
+            int variable_len = random_u32() % (VARIABLE_LEN + 3);
+            int value_len = random_u32() % (VALUE_LEN + 3);
+            for (int i = 0; i < variable_len; i++)
+            {
+                stream += 'a' + random_u32() % 26;
+            }
+            stream += '=';
+            for (int i = 0; i < value_len; i++)
+            {
+                stream += '0' + random_u32() % 10;
+            }
+            stream += '#';
+            break;
+        }
+        }
+    }
+
+    return stream;
+}
+
+// 1 to 32 bytes, sometimes all the rest
+static size_t random_fragment_size(size_t remaining)
+{
+    if (random_u32() % 8 == 0)
+    {
+        return remaining;
+    }
+
+    size_t size = 1 + random_u32() % 32;
+    return size < remaining ? size : remaining;
+}
+
+static bool fuzz(int streams)
+{
+    MessageParser<message_t> parser;
+    parser_context_t context;
+    context.storage_available = true;
+
+    for (int n = 0; n < streams; n++)
+    {
+        std::string stream = random_stream();
+
+        parser.init(&acquire_message, &complete_message, &context);
+        context.messages.clear();
+
+        // Fed in fragments of random sizes, as the ATT writes arrive
+        size_t offset = 0;
+        while (offset < stream.size())
+        {
+            size_t size = random_fragment_size(stream.size() - offset);
+            parser.parse((const uint8_t *)stream.data() + offset, size);
+            offset += size;
+        }
+
+        std::vector<std::string> expected;
+        uint32_t expected_overflows = 0;
+        reference_parse(stream, &expected, &expected_overflows);
+
+        if (context.messages != expected || parser.get_overflows() != expected_overflows)
+        {
+            printf("Mismatch on stream %d (%zu bytes): %zu messages, reference %zu; %u overflows, reference %u\n",
+                   n, stream.size(), context.messages.size(), expected.size(), parser.get_overflows(), expected_overflows);
+            return false;
+        }
+    }
+
+    // No storage: everything is discarded up to the next #
+    context.storage_available = false;
+    context.messages.clear();
+    parser.init(&acquire_message, &complete_message, &context);
+    const char *text = "Led=1#Knob=2#";
+    parser.parse((const uint8_t *)text, strlen(text));
+    context.storage_available = true;
+    text = "Led=3#";
+    parser.parse((const uint8_t *)text, strlen(text));
+    if (context.messages.size() != 1 || context.messages[0] != "Led=3")
+    {
+        printf("Messages without storage were not discarded\n");
+        return false;
+    }
+
+    return true;
+}
+
+static uint32_t throughput_messages;
+
+static void count_message(void *, message_t *)
+{
+    throughput_messages++;
+}
+
+static void throughput()
+{
+    std::string stream;
+    while (stream.size() < THROUGHPUT_BYTES)
+    {
+        stream += "Knob1=123.45#Led=1#Msg=Hello, this is your Pico W board!#";
+    }
+
+    MessageParser<message_t> parser;
+    parser_context_t context;
+    context.storage_available = true;
+    parser.init(&acquire_message, &count_message, &context);
+
+    // 20 byte fragments: the payload of a write with the default ATT MTU
+    auto start = std::chrono::steady_clock::now();
+    for (size_t offset = 0; offset < stream.size(); offset += 20)
+    {
+        size_t size = stream.size() - offset;
+        parser.parse((const uint8_t *)stream.data() + offset, size < 20 ? size : 20);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf("Throughput: %.1f MB/s, %.1f M messages/s\n", stream.size() / seconds / 1e6, throughput_messages / seconds / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    int streams = argc > 1 ? atoi(argv[1]) : DEFAULT_STREAMS;
+    if (streams <= 0)
+    {
+        printf("Usage: %s [streams]\n", argv[0]);
+        return 1;
+    }
+
+    if (!fuzz(streams))
+    {
+        return 1;
+    }
+    printf("%d random streams, no mismatches\n", streams);
+
+    throughput();
+
+    return 0;
+}